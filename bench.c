@@ -0,0 +1,468 @@
+// Benchmarks of the shell. The shell's source is included with its main left out, so every
+// benchmark calls the very functions the shell runs. Each benchmark runs once to warm up and
+// then BENCH_REPEAT times (7 by default); the median, the extremes and the median absolute
+// deviation of the runs go to bench_output.txt as a table and to bench_results.json.
+// Usage: myshell_bench [path of the myshell binary, for the startup benchmark]
+#define MYSHELL_NO_MAIN
+#include "ceng322_pa2.c"
+#include <math.h>
+#include <spawn.h>
+#include <sys/utsname.h>
+
+#define BENCH_DEFAULT_REPEAT 7      // Measured runs of every benchmark
+#define BENCH_MAX_REPEAT 64
+#define BENCH_MAX_RESULTS 32
+#define BENCH_PIPE_BYTES (64 << 20) // Bytes pushed through the pipeline benchmarks
+#define BENCH_WC_BYTES (256 << 20)  // Size of the text file wc counts
+#define BENCH_COUNT_LINES 1000000   // Lines of the file count and sort | uniq -c | sort -rn read
+#define BENCH_COUNT_KEYS 50000      // Distinct lines among them
+
+// Values of one benchmark over its runs
+struct bench_result {
+    const char *name;
+    const char *unit;
+    int runs;
+    double values[BENCH_MAX_REPEAT];
+    double median, min, max, mad;   // mad: median absolute deviation from the median
+};
+
+struct bench_result bench_results[BENCH_MAX_RESULTS];
+int bench_result_count = 0;
+int bench_repeat = BENCH_DEFAULT_REPEAT;
+const char *bench_shell_path = "./myshell";
+int bench_saved_stdout = -1;
+char bench_wc_file[] = "/tmp/mbwXXXXXX";       // Short names keep the command lines under
+char bench_count_file[] = "/tmp/mbcXXXXXX";    // MAX_COMMAND_LENGTH
+
+// Function for the time in seconds on the monotonic clock
+static double bench_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Function for comparing two doubles for qsort
+static int bench_compare(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Function for the median of count sorted values
+static double bench_median(const double *sorted, int count) {
+    return count % 2 != 0 ? sorted[count / 2] : (sorted[count / 2 - 1] + sorted[count / 2]) / 2;
+}
+
+// Function for sending the shell's output to /dev/null while a benchmark runs commands, and back
+static void bench_quiet(int quiet) {
+    fflush(stdout);
+    if (quiet) {
+        int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        bench_saved_stdout = dup(STDOUT_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+    } else {
+        dup2(bench_saved_stdout, STDOUT_FILENO);
+        close(bench_saved_stdout);
+    }
+}
+
+// Function for adding a result whose runs are the ratios of the runs of two earlier results,
+// such as the speedup of one way of doing something over another
+static void bench_ratio(const char *name, const char *numerator, const char *denominator) {
+    struct bench_result *top = NULL, *bottom = NULL;
+    for (int b = 0; b < bench_result_count; b++) {
+        top = strcmp(bench_results[b].name, numerator) == 0 ? &bench_results[b] : top;
+        bottom = strcmp(bench_results[b].name, denominator) == 0 ? &bench_results[b] : bottom;
+    }
+    if (top == NULL || bottom == NULL || bench_result_count == BENCH_MAX_RESULTS) {
+        return;
+    }
+    struct bench_result *result = &bench_results[bench_result_count++];
+    result->name = name;
+    result->unit = "x";
+    result->runs = top->runs;
+    double sorted[BENCH_MAX_REPEAT], deviations[BENCH_MAX_REPEAT];
+    for (int r = 0; r < result->runs; r++) {
+        result->values[r] = bottom->values[r] != 0 ? top->values[r] / bottom->values[r] : 0;
+    }
+    memcpy(sorted, result->values, result->runs * sizeof(double));
+    qsort(sorted, result->runs, sizeof(double), bench_compare);
+    result->median = bench_median(sorted, result->runs);
+    result->min = sorted[0];
+    result->max = sorted[result->runs - 1];
+    for (int r = 0; r < result->runs; r++) {
+        deviations[r] = fabs(sorted[r] - result->median);
+    }
+    qsort(deviations, result->runs, sizeof(double), bench_compare);
+    result->mad = bench_median(deviations, result->runs);
+}
+
+// Function for running a benchmark: one warmup run, then bench_repeat measured runs of run(),
+// which returns the value of one run in the given unit
+static void bench_run(const char *name, const char *unit, double (*run)(void)) {
+    if (bench_result_count == BENCH_MAX_RESULTS) {
+        return;
+    }
+    fprintf(stderr, "bench: %s\n", name);
+    struct bench_result *result = &bench_results[bench_result_count++];
+    result->name = name;
+    result->unit = unit;
+    result->runs = bench_repeat;
+    bench_quiet(1);
+    run();
+    for (int r = 0; r < bench_repeat; r++) {
+        result->values[r] = run();
+    }
+    bench_quiet(0);
+
+    double sorted[BENCH_MAX_REPEAT], deviations[BENCH_MAX_REPEAT];
+    memcpy(sorted, result->values, bench_repeat * sizeof(double));
+    qsort(sorted, bench_repeat, sizeof(double), bench_compare);
+    result->median = bench_median(sorted, bench_repeat);
+    result->min = sorted[0];
+    result->max = sorted[bench_repeat - 1];
+    for (int r = 0; r < bench_repeat; r++) {
+        deviations[r] = fabs(sorted[r] - result->median);
+    }
+    qsort(deviations, bench_repeat, sizeof(double), bench_compare);
+    result->mad = bench_median(deviations, bench_repeat);
+}
+
+// Command lines of the parser benchmark, shaped like what people type
+static const char *bench_lines[] = {
+    "ls -la /usr/include",
+    "fgrep -i error /var/log/syslog | sort | count | head -n 20",
+    "gcc -O2 -Wall main.c -o main && ./main input.txt",
+    "walk . -name *.c | xargs -n 16 wc -l | sort -n | tail -n 5",
+    "sleep 10 &",
+    "cp -r src backup && rm -r -f build",
+};
+
+// Function for the tokenizer and parser throughput in MB/s
+static double bench_parse(void) {
+    struct parsed_command parsed;
+    char line[MAX_COMMAND_LENGTH];
+    int line_count = sizeof(bench_lines) / sizeof(bench_lines[0]);
+    size_t bytes = 0;
+    double start = bench_now();
+    for (int i = 0; i < 300000; i++) {
+        const char *text = bench_lines[i % line_count];
+        size_t length = strlen(text);
+        memcpy(line, text, length + 1);
+        parse_command_line(line, &parsed);
+        bytes += length;
+    }
+    return bytes / (bench_now() - start) / 1e6;
+}
+
+// Function for the cost of appending to the local history array, in ns per command
+static double bench_history_local(void) {
+    int count = 1000000;
+    double start = bench_now();
+    for (int i = 0; i < count; i++) {
+        add_to_history(bench_lines[i % 6]);
+    }
+    return (bench_now() - start) * 1e9 / count;
+}
+
+// Function for the cost of appending to a shared history file, in ns per command
+static double bench_history_shared(void) {
+    char path[] = "/tmp/myshell_bench_history_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return 0;
+    }
+    close(fd);
+    unlink(path);   // open_shared_history creates and sizes it
+    open_shared_history(path);
+    int count = 1000000;
+    double start = bench_now();
+    for (int i = 0; i < count; i++) {
+        add_to_history(bench_lines[i % 6]);
+    }
+    double elapsed = bench_now() - start;
+    if (shared_history != NULL) {
+        munmap(shared_history, sizeof(*shared_history) + shared_history->capacity);
+        shared_history = NULL;
+    }
+    unlink(path);
+    return elapsed * 1e9 / count;
+}
+
+char *bench_true_argv[] = {"true", NULL};
+
+// Function for the latency of fork, exec of true and wait, in microseconds
+static double bench_spawn_fork(void) {
+    int count = 300;
+    double start = bench_now();
+    for (int i = 0; i < count; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            execvp("true", bench_true_argv);
+            _exit(127);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return (bench_now() - start) * 1e6 / count;
+}
+
+// Function for starting true with vfork, which does not copy the page tables. The child only
+// execs or exits, so it never touches the caller's variables.
+static pid_t bench_vfork_true(void) {
+    pid_t pid = vfork();
+    if (pid == 0) {
+        execvp("true", bench_true_argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+// Function for the same latency with vfork
+static double bench_spawn_vfork(void) {
+    int count = 300;
+    double start = bench_now();
+    for (int i = 0; i < count; i++) {
+        waitpid(bench_vfork_true(), NULL, 0);
+    }
+    return (bench_now() - start) * 1e6 / count;
+}
+
+// Function for the same with posix_spawnp
+static double bench_spawn_posix(void) {
+    int count = 300;
+    double start = bench_now();
+    for (int i = 0; i < count; i++) {
+        pid_t pid;
+        if (posix_spawnp(&pid, "true", NULL, NULL, bench_true_argv, environ) == 0) {
+            waitpid(pid, NULL, 0);
+        }
+    }
+    return (bench_now() - start) * 1e6 / count;
+}
+
+// Function for the latency of the shell's own launcher (fork, exec, reap with accounting)
+static double bench_spawn_shell(void) {
+    int count = 300;
+    double start = bench_now();
+    for (int i = 0; i < count; i++) {
+        run_sequence_command(bench_true_argv, 0);
+    }
+    return (bench_now() - start) * 1e6 / count;
+}
+
+// Function for running one command line the way the shell does, returns the seconds it took
+static double bench_command_line(const char *text) {
+    char line[MAX_COMMAND_LENGTH];
+    strncpy(line, text, sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\0';
+    double start = bench_now();
+    execute_command_line(line);
+    return bench_now() - start;
+}
+
+// Function for the throughput of an external producer into the wc builtin, in MB/s
+static double bench_pipe_2(void) {
+    char line[MAX_COMMAND_LENGTH];
+    snprintf(line, sizeof(line), "/usr/bin/head -c %d /dev/zero | wc -c", BENCH_PIPE_BYTES);
+    return BENCH_PIPE_BYTES / bench_command_line(line) / 1e6;
+}
+
+// Function for the throughput through four external cat stages, in MB/s
+static double bench_pipe_n(void) {
+    char line[MAX_COMMAND_LENGTH];
+    snprintf(line, sizeof(line), "/usr/bin/head -c %d /dev/zero | cat | cat | cat | cat | wc -c", BENCH_PIPE_BYTES);
+    return BENCH_PIPE_BYTES / bench_command_line(line) / 1e6;
+}
+
+// Function for the throughput between two fused builtin stages, in MB/s
+static double bench_pipe_builtin(void) {
+    char line[MAX_COMMAND_LENGTH];
+    snprintf(line, sizeof(line), "head -c %d /dev/zero | wc -c", BENCH_PIPE_BYTES);
+    return BENCH_PIPE_BYTES / bench_command_line(line) / 1e6;
+}
+
+// Function for writing the input files of the wc and count benchmarks: words from a fixed
+// pseudo-random sequence, so every run and every machine reads the same bytes
+static int bench_write_inputs(void) {
+    int wc_fd = mkstemp(bench_wc_file), count_fd = mkstemp(bench_count_file);
+    FILE *wc_file = wc_fd >= 0 ? fdopen(wc_fd, "w") : NULL;
+    FILE *count_file = count_fd >= 0 ? fdopen(count_fd, "w") : NULL;
+    if (wc_file == NULL || count_file == NULL) {
+        perror("bench inputs");
+        return -1;
+    }
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    long written = 0;
+    while (written < BENCH_WC_BYTES) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        int words = 1 + (state >> 60);
+        for (int w = 0; w < words; w++) {
+            written += fprintf(wc_file, w == 0 ? "word%llu" : " word%llu", (unsigned long long)((state >> (w * 3)) % 10000));
+        }
+        written += fprintf(wc_file, "\n");
+    }
+    for (int i = 0; i < BENCH_COUNT_LINES; i++) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        fprintf(count_file, "key-%llu\n", (unsigned long long)((state >> 33) % BENCH_COUNT_KEYS));
+    }
+    fclose(wc_file);
+    fclose(count_file);
+    return 0;
+}
+
+// Function for the throughput of the wc builtin over a mapped file, in GB/s
+static double bench_wc_mapped(void) {
+    char line[MAX_COMMAND_LENGTH];
+    snprintf(line, sizeof(line), "wc %s", bench_wc_file);
+    return BENCH_WC_BYTES / bench_command_line(line) / 1e9;
+}
+
+// Function for the count builtin over the count input, in milliseconds
+static double bench_count(void) {
+    char line[MAX_COMMAND_LENGTH];
+    snprintf(line, sizeof(line), "count %s", bench_count_file);
+    return bench_command_line(line) * 1e3;
+}
+
+// Function for the three-process pipeline count replaces over the same input, in milliseconds
+static double bench_count_pipeline(void) {
+    char line[MAX_COMMAND_LENGTH];
+    snprintf(line, sizeof(line), "/usr/bin/sort %s | /usr/bin/uniq -c | /usr/bin/sort -rn", bench_count_file);
+    return bench_command_line(line) * 1e3;
+}
+
+// Function for a single true, in microseconds
+static double bench_simple(void) {
+    int count = 200;
+    double total = 0;
+    for (int i = 0; i < count; i++) {
+        total += bench_command_line("true");
+    }
+    return total * 1e6 / count;
+}
+
+// Function for "true && true", in microseconds (compare with twice simple_command)
+static double bench_and_chain(void) {
+    int count = 200;
+    double total = 0;
+    for (int i = 0; i < count; i++) {
+        total += bench_command_line("true && true");
+    }
+    return total * 1e6 / count;
+}
+
+// Function for running a builtin that does no work (set +x, near the end of the dispatch
+// chain), in ns
+static double bench_builtin_dispatch(void) {
+    char *args[] = {"set", "+x", NULL};
+    int count = 200000;
+    double start = bench_now();
+    for (int i = 0; i < count; i++) {
+        run_simple_command(args, 0);
+    }
+    return (bench_now() - start) * 1e9 / count;
+}
+
+// Function for the time the shell binary takes to start and exit at end of input, in milliseconds
+static double bench_startup(void) {
+    char *argv[] = {(char *)bench_shell_path, NULL};
+    int count = 50;
+    double start = bench_now();
+    for (int i = 0; i < count; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            int null_fd = open("/dev/null", O_RDWR);
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            execv(bench_shell_path, argv);
+            _exit(127);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return (bench_now() - start) * 1e3 / count;
+}
+
+// Function for writing the results as a table and as JSON
+static void bench_write_reports(void) {
+    struct utsname system;
+    uname(&system);
+    time_t now = time(NULL);
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    FILE *table = fopen("bench_output.txt", "w");
+    FILE *json = fopen("bench_results.json", "w");
+    if (table == NULL || json == NULL) {
+        perror("bench reports");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(table, "# %s, %s %s, %ld cpus, %s, warmup 1, runs %d\n", date, system.sysname, system.release,
+            sysconf(_SC_NPROCESSORS_ONLN), __VERSION__, bench_repeat);
+    fprintf(table, "%-22s %-6s %12s %12s %12s %12s %8s\n", "benchmark", "unit", "median", "min", "max", "mad", "spread");
+    fprintf(json, "{\n  \"date\": \"%s\",\n  \"kernel\": \"%s %s\",\n  \"cpus\": %ld,\n  \"compiler\": \"%s\",\n"
+            "  \"warmup\": 1,\n  \"runs\": %d,\n  \"results\": [\n", date, system.sysname, system.release,
+            sysconf(_SC_NPROCESSORS_ONLN), __VERSION__, bench_repeat);
+    for (int b = 0; b < bench_result_count; b++) {
+        struct bench_result *result = &bench_results[b];
+        double spread = result->median != 0 ? (result->max - result->min) / fabs(result->median) * 100 : 0;
+        fprintf(table, "%-22s %-6s %12.3f %12.3f %12.3f %12.3f %7.1f%%\n", result->name, result->unit,
+                result->median, result->min, result->max, result->mad, spread);
+        fprintf(json, "    {\"name\": \"%s\", \"unit\": \"%s\", \"median\": %.6f, \"min\": %.6f, \"max\": %.6f, "
+                "\"mad\": %.6f, \"values\": [", result->name, result->unit, result->median, result->min,
+                result->max, result->mad);
+        for (int r = 0; r < result->runs; r++) {
+            fprintf(json, r == 0 ? "%.6f" : ", %.6f", result->values[r]);
+        }
+        fprintf(json, "]}%s\n", b == bench_result_count - 1 ? "" : ",");
+    }
+    fprintf(json, "  ]\n}\n");
+    fclose(table);
+    fclose(json);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) {
+        bench_shell_path = argv[1];
+    }
+    char *repeat = getenv("BENCH_REPEAT");
+    if (repeat != NULL && atoi(repeat) > 0) {
+        bench_repeat = atoi(repeat) < BENCH_MAX_REPEAT ? atoi(repeat) : BENCH_MAX_REPEAT;
+    }
+    signal(SIGPIPE, SIG_IGN);   // As in the shell
+    setenv("LC_ALL", "C", 1);   // The external sort compares bytes, as the builtins do
+    if (bench_write_inputs() < 0) {
+        return 1;
+    }
+
+    bench_run("parse", "MB/s", bench_parse);
+    bench_run("history_append_local", "ns", bench_history_local);
+    bench_run("history_append_shared", "ns", bench_history_shared);
+    bench_run("spawn_fork", "us", bench_spawn_fork);
+    bench_run("spawn_vfork", "us", bench_spawn_vfork);
+    bench_run("spawn_posix_spawn", "us", bench_spawn_posix);
+    bench_run("spawn_shell_launcher", "us", bench_spawn_shell);
+    bench_run("pipe_2_stage", "MB/s", bench_pipe_2);
+    bench_run("pipe_6_stage", "MB/s", bench_pipe_n);
+    bench_run("pipe_builtin_fused", "MB/s", bench_pipe_builtin);
+    bench_run("wc_mapped", "GB/s", bench_wc_mapped);
+    bench_run("count_builtin", "ms", bench_count);
+    bench_run("count_sort_uniq_sort", "ms", bench_count_pipeline);
+    bench_ratio("count_speedup", "count_sort_uniq_sort", "count_builtin");
+    bench_run("simple_command", "us", bench_simple);
+    bench_run("and_chain", "us", bench_and_chain);
+    bench_run("builtin_dispatch", "ns", bench_builtin_dispatch);
+    bench_run("startup", "ms", bench_startup);
+
+    bench_write_reports();
+    unlink(bench_wc_file);
+    unlink(bench_count_file);
+    FILE *table = fopen("bench_output.txt", "r");
+    char text[256];
+    while (table != NULL && fgets(text, sizeof(text), table) != NULL) {
+        fputs(text, stdout);
+    }
+    if (table != NULL) {
+        fclose(table);
+    }
+    return 0;
+}
@@ -1,20 +1,272 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#include <sys/prctl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <linux/perf_event.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
 
 #define MAX_COMMAND_LENGTH 100  // Maximum length of a command
 #define MAX_ARGS 11             // Maximum number of arguments for a command
 #define HISTORY_SIZE 10         // Size of the command history
+#define MAX_PIPELINE_STAGES 8   // Maximum number of commands connected with |
+#define STREAM_BUFFER_SIZE 65536    // Output buffer of a builtin
+#define SPSC_RING_SIZE (1 << 20)    // Bytes buffered between two fused builtin stages
+#define FGREP_CHUNK_SIZE (4 << 20)  // Slice of a mapped file searched by one pool task
+#define FGREP_READ_SIZE (1 << 20)   // Size of the reads fgrep issues on pipes
+#define WC_CHUNK_SIZE (8 << 20)     // Slice of a mapped file counted by one pool task
+#define WC_READ_SIZE (1 << 20)      // Size of the reads wc issues on pipes
+#define ARENA_BLOCK_SIZE (1 << 20)  // Allocation unit of the arena allocator
+#define LINE_READ_SIZE (1 << 20)    // Size of the reads when splitting a stream into lines
+#define SORT_DEFAULT_BUDGET ((size_t)256 << 20)   // Input sort keeps in memory before spilling a run
+#define SORT_MAX_RUNS 64            // Spilled runs merged at once
+#define SORT_MIN_CHUNK 65536        // Fewest records worth sorting on a separate worker
+#define SORT_RADIX_CUTOFF 64        // Below this many records radix sorting hands over to qsort
+#define SORT_RADIX_MAX_LEVELS 32    // Nested radix passes before the rest is left to qsort
+#define COUNT_CHUNK_SIZE (4 << 20)  // Block of lines hashed by one pool task
+#define WALK_DIRENT_BUFFER 65536    // Buffer for one getdents64 call
+#define HASHSUM_READ_SIZE (1 << 20) // Size of the reads hashsum issues on pipes
+#define COPY_BLOCK_SIZE (1 << 20)   // Buffer of the read/write fallback of cp
+#define TAIL_READ_SIZE (1 << 16)    // Size of the reads head and tail issue on pipes
+#define TAIL_WINDOW_MIN (1 << 20)   // Smallest window tail keeps of a pipe before trimming it
+#define TAIL_FOLLOW_RECHECK 1000    // Milliseconds between checks whether tail -f's file was replaced
+#define FANOUT_CHUNK_SIZE (1 << 16)         // Input handed to a fanout child at a time
+#define FANOUT_ORDERED_CHUNK_SIZE (1 << 20) // Input of one fanout -k process
+#define FANOUT_READ_SIZE (1 << 16)          // Size of the reads fanout issues
+#define SHARD_BLOCK_SIZE (1 << 20)  // Input shard distributes between two flushes of its files
+#define SHARD_MAX_FILES 1024        // Most output files shard writes at once
+#define XARGS_MAX_ARGUMENT 131072   // Longest single argument execve accepts (MAX_ARG_STRLEN)
+#define MAX_JOBS 64                 // Jobs the shell keeps track of at once
+#define MAX_COPROCESSES 8           // Coprocesses that can run at once
+#define XTRACE_BUFFER_SIZE (1 << 16)    // Trace output collected before one write to XTRACEFD
+#define PROFILE_BUFFER_SAMPLES 256  // Line samples a thread buffers before folding them into the totals
+#define METRIC_SUB_BUCKETS 16       // Histogram buckets per power of two (values within 1/16 of each other share one)
+#define METRIC_BUCKETS (45 * METRIC_SUB_BUCKETS)   // Enough for latencies up to 2^48 ns
+#define SHARED_HISTORY_CAPACITY (1 << 16)           // Bytes of the record area in the shared history file (power of two)
+#define SHARED_HISTORY_ALIGN 16                     // Every record starts on this boundary
+#define SHARED_HISTORY_MAGIC 0x5453494848594d53ULL  // "SMYHHIST" marks an initialized shared history file
+
+// Metrics registry: counters and latency histograms of the shell itself. Every thread that
+// records has a shard of its own, written without locks or atomic read-modify-writes, and the
+// shards are only added up when somebody reads them (stats). Histograms are HDR-style:
+// exact below METRIC_SUB_BUCKETS ns, above that METRIC_SUB_BUCKETS buckets per power of two.
+enum metric_counter {
+    COUNTER_COMMAND_LINES, COUNTER_PROCESSES, COUNTER_SPAWN_FAILURES, COUNTER_FAILED_COMMANDS, COUNTER_BUILTINS,
+    COUNTER_BACKGROUND_JOBS, COUNTER_COUNT
+};
+enum metric_histogram { HISTOGRAM_SPAWN, HISTOGRAM_PARSE, HISTOGRAM_WAIT, HISTOGRAM_HISTORY, HISTOGRAM_BUILTIN, HISTOGRAM_COUNT };
+const char *counter_names[COUNTER_COUNT] = {"command_lines", "processes", "spawn_failures", "failed_commands", "builtins",
+                                            "background_jobs"};
+const char *histogram_names[HISTOGRAM_COUNT] = {"spawn", "parse", "wait", "history_append", "builtin"};
+
+struct metrics_shard {
+    struct metrics_shard *next;
+    struct metrics_shard *next_free;            // In metrics_free after its thread exited
+    _Atomic uint64_t counters[COUNTER_COUNT];
+    _Atomic uint64_t buckets[HISTOGRAM_COUNT][METRIC_BUCKETS];
+    _Atomic uint64_t sums[HISTOGRAM_COUNT];     // Nanoseconds, for the mean
+};
+
+_Atomic(struct metrics_shard *) metrics_shards = NULL;  // Shards are pushed once and never freed
+atomic_int active_jobs;     // Background jobs in the job table, a gauge
+__thread struct metrics_shard *metrics_shard = NULL;
+// Shards of threads that exited, handed to the next new thread with their values kept, so
+// short-lived stage threads do not add a shard each
+struct metrics_shard *metrics_free = NULL;
+pthread_mutex_t metrics_free_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t metrics_key;
+pthread_once_t metrics_key_once = PTHREAD_ONCE_INIT;
+
+// Function for retiring the shard of an exiting thread (destructor of metrics_key)
+static void metrics_retire(void *arg) {
+    struct metrics_shard *shard = arg;
+    pthread_mutex_lock(&metrics_free_lock);
+    shard->next_free = metrics_free;
+    metrics_free = shard;
+    pthread_mutex_unlock(&metrics_free_lock);
+}
+
+static void metrics_key_create(void) {
+    pthread_key_create(&metrics_key, metrics_retire);
+}
+
+// Function for the calling thread's shard, taken over or created the first time it records something
+static struct metrics_shard *metrics_local(void) {
+    struct metrics_shard *shard = metrics_shard;
+    if (shard == NULL) {
+        pthread_once(&metrics_key_once, metrics_key_create);
+        pthread_mutex_lock(&metrics_free_lock);
+        shard = metrics_free;
+        if (shard != NULL) {
+            metrics_free = shard->next_free;
+        }
+        pthread_mutex_unlock(&metrics_free_lock);
+        if (shard == NULL) {
+            shard = calloc(1, sizeof(*shard));
+            if (shard == NULL) {
+                return NULL;
+            }
+            shard->next = atomic_load(&metrics_shards);
+            while (!atomic_compare_exchange_weak(&metrics_shards, &shard->next, shard)) {
+            }
+        }
+        pthread_setspecific(metrics_key, shard);
+        metrics_shard = shard;
+    }
+    return shard;
+}
+
+// Function for bumping a value only this thread writes (a reset may race with it and lose it)
+static inline void metric_add(_Atomic uint64_t *value, uint64_t amount) {
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+// Function for counting an event
+void metric_count(enum metric_counter counter) {
+    struct metrics_shard *shard = metrics_local();
+    if (shard != NULL) {
+        metric_add(&shard->counters[counter], 1);
+    }
+}
+
+// Function for the bucket of a value
+static int metric_bucket(uint64_t value) {
+    if (value < METRIC_SUB_BUCKETS) {
+        return (int)value;
+    }
+    int exponent = 63 - __builtin_clzll(value);     // At least 4
+    int bucket = (exponent - 3) * METRIC_SUB_BUCKETS + (int)((value >> (exponent - 4)) & (METRIC_SUB_BUCKETS - 1));
+    return bucket < METRIC_BUCKETS ? bucket : METRIC_BUCKETS - 1;
+}
+
+// Function for the smallest value that falls into a bucket and the width of the bucket
+static uint64_t metric_bucket_start(int bucket, uint64_t *width) {
+    if (bucket < METRIC_SUB_BUCKETS) {
+        *width = 1;
+        return bucket;
+    }
+    int exponent = bucket / METRIC_SUB_BUCKETS + 3;
+    *width = 1ULL << (exponent - 4);
+    return (uint64_t)(METRIC_SUB_BUCKETS + bucket % METRIC_SUB_BUCKETS) << (exponent - 4);
+}
+
+// Function for a monotonic time stamp in nanoseconds, the start of a measurement
+uint64_t metric_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Function for recording the time since start in a histogram
+void metric_record(enum metric_histogram histogram, uint64_t start) {
+    uint64_t elapsed = metric_now() - start;
+    struct metrics_shard *shard = metrics_local();
+    if (shard != NULL) {
+        metric_add(&shard->buckets[histogram][metric_bucket(elapsed)], 1);
+        metric_add(&shard->sums[histogram], elapsed);
+    }
+}
+
+// One histogram with the shards added up
+struct metric_summary {
+    uint64_t count, sum;
+    uint64_t buckets[METRIC_BUCKETS];
+};
+
+// Function for adding up a histogram over all shards
+void metric_merge(enum metric_histogram histogram, struct metric_summary *summary) {
+    memset(summary, 0, sizeof(*summary));
+    for (struct metrics_shard *shard = atomic_load(&metrics_shards); shard != NULL; shard = shard->next) {
+        for (int b = 0; b < METRIC_BUCKETS; b++) {
+            uint64_t count = atomic_load_explicit(&shard->buckets[histogram][b], memory_order_relaxed);
+            summary->buckets[b] += count;
+            summary->count += count;
+        }
+        summary->sum += atomic_load_explicit(&shard->sums[histogram], memory_order_relaxed);
+    }
+}
+
+// Function for adding up a counter over all shards
+uint64_t metric_counter_total(enum metric_counter counter) {
+    uint64_t total = 0;
+    for (struct metrics_shard *shard = atomic_load(&metrics_shards); shard != NULL; shard = shard->next) {
+        total += atomic_load_explicit(&shard->counters[counter], memory_order_relaxed);
+    }
+    return total;
+}
+
+// Function for the value below which the given fraction of a histogram lies (the middle of
+// its bucket), 0 for an empty histogram
+uint64_t metric_percentile(const struct metric_summary *summary, double fraction) {
+    if (summary->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(fraction * summary->count + 0.999999), seen = 0, width;
+    rank = rank != 0 ? rank : 1;
+    for (int b = 0; b < METRIC_BUCKETS; b++) {
+        seen += summary->buckets[b];
+        if (seen >= rank) {
+            uint64_t start = metric_bucket_start(b, &width);
+            return start + width / 2;
+        }
+    }
+    return 0;
+}
+
+// Function for clearing every counter and histogram
+void metrics_reset(void) {
+    for (struct metrics_shard *shard = atomic_load(&metrics_shards); shard != NULL; shard = shard->next) {
+        for (int c = 0; c < COUNTER_COUNT; c++) {
+            atomic_store_explicit(&shard->counters[c], 0, memory_order_relaxed);
+        }
+        for (int h = 0; h < HISTOGRAM_COUNT; h++) {
+            for (int b = 0; b < METRIC_BUCKETS; b++) {
+                atomic_store_explicit(&shard->buckets[h][b], 0, memory_order_relaxed);
+            }
+            atomic_store_explicit(&shard->sums[h], 0, memory_order_relaxed);
+        }
+    }
+}
 
 // Array to store command history
 char history[HISTORY_SIZE][MAX_COMMAND_LENGTH];
 int history_count = 0;          // Counter for the number of commands in history
+pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;   // The history builtin may run on a pool thread
 
-// Function for adding a command to the history array
+// Function for pushing a command into the local history array
 // it is working with FIFO principle to obtain last 10 command in order
-void add_to_history(const char *command) {
+static void push_history_entry(const char *command) {
     if (history_count == HISTORY_SIZE) {
         // Shifting history to make space for new command
         for (int i = 0; i < HISTORY_SIZE - 1; i++) {
@@ -29,213 +281,7081 @@ void add_to_history(const char *command) {
     }
 }
 
-
-// Function for changing the current working directory
-void change_directory(char **args) {
-    char *path;
-
-    if (args[1] == NULL) {  // If there is no argument to change dir, new directory is default dir. 
-        char *home_directory = getenv("HOME");
-        if (home_directory == NULL) {
-            fprintf(stderr, "HOME environment variable not set\n"); 
-            return;
+// Shared history is an optional memory-mapped file (path in MYSHELL_SHARED_HISTORY) that all
+// sessions append to. The record area is a multi-producer ring of variable-length records:
+// a writer reserves bytes with a compare-and-swap on `reserved`, fills its record in and then
+// publishes it by storing `commit` with release semantics. Positions grow forever and the
+// offset of a record is its position modulo the capacity, so nobody ever takes a lock.
+struct shared_history_header {
+    uint64_t magic;
+    uint64_t capacity;
+    _Atomic uint64_t reserved;      // Total number of bytes reserved by all sessions so far
+    uint64_t unused[5];             // Keeps the record area on its own cache line
+};
+
+enum { SHARED_RECORD_COMMAND = 1, SHARED_RECORD_PADDING = 2 };
+
+struct shared_history_record {
+    _Atomic uint64_t commit;        // Position of the record plus one once it is complete
+    _Atomic uint32_t length;        // Number of bytes of command text (without terminator)
+    _Atomic uint32_t kind;          // SHARED_RECORD_COMMAND or SHARED_RECORD_PADDING
+    char text[];
+};
+
+struct shared_history_header *shared_history = NULL;   // NULL when shared history is disabled
+char *shared_history_area = NULL;                      // Start of the record area
+uint64_t shared_history_cursor = 0;                    // Position up to which this session has read
+
+static uint64_t shared_record_size(uint64_t length) {
+    uint64_t size = sizeof(struct shared_history_record) + length;
+    return (size + SHARED_HISTORY_ALIGN - 1) & ~(uint64_t)(SHARED_HISTORY_ALIGN - 1);
+}
+
+// Function for mapping the shared history file, creating and initializing it when it is new
+void open_shared_history(const char *path) {
+    size_t file_size = sizeof(struct shared_history_header) + SHARED_HISTORY_CAPACITY;
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        perror("shared history");
+        return;
+    }
+    // The lock only serializes initialization of a new file; appends and reads never take it.
+    flock(fd, LOCK_EX);
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size == 0 && ftruncate(fd, file_size) != 0) {
+        perror("ftruncate");
+    }
+    void *map = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        flock(fd, LOCK_UN);
+        close(fd);
+        return;
+    }
+    struct shared_history_header *header = map;
+    if (header->magic == 0) {
+        header->capacity = SHARED_HISTORY_CAPACITY;
+        header->magic = SHARED_HISTORY_MAGIC;
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    if (header->magic != SHARED_HISTORY_MAGIC || header->capacity != SHARED_HISTORY_CAPACITY) {
+        fprintf(stderr, "shared history: %s is not a compatible history file\n", path);
+        munmap(map, file_size);
+        return;
+    }
+    shared_history = header;
+    shared_history_area = (char *)map + sizeof(struct shared_history_header);
+    // A new session starts from the oldest command that is still in the ring.
+    uint64_t reserved = atomic_load_explicit(&header->reserved, memory_order_acquire);
+    shared_history_cursor = reserved > SHARED_HISTORY_CAPACITY ? reserved - SHARED_HISTORY_CAPACITY : 0;
+}
+
+// Function for filling in and publishing one record at the given position
+static void write_shared_record(uint64_t pos, uint32_t kind, const char *text, uint32_t length) {
+    struct shared_history_record *record =
+        (struct shared_history_record *)(shared_history_area + (pos & (SHARED_HISTORY_CAPACITY - 1)));
+    atomic_store_explicit(&record->length, length, memory_order_relaxed);
+    atomic_store_explicit(&record->kind, kind, memory_order_relaxed);
+    if (kind == SHARED_RECORD_COMMAND) {
+        memcpy(record->text, text, length);
+        // Filling the tail with 0xff means no aligned slot inside a record can look like a committed header.
+        memset(record->text + length, 0xff, shared_record_size(length) - sizeof(*record) - length);
+    }
+    atomic_store_explicit(&record->commit, pos + 1, memory_order_release);
+}
+
+// Function for appending a command to the shared history without any locking
+static void shared_history_append(const char *command) {
+    uint32_t length = strnlen(command, MAX_COMMAND_LENGTH - 1);
+    uint64_t need = shared_record_size(length);
+    uint64_t current = atomic_load_explicit(&shared_history->reserved, memory_order_relaxed);
+    uint64_t pad, start;
+    do {
+        // A record never wraps around the end of the area; the rest of the lap becomes padding.
+        uint64_t offset = current & (SHARED_HISTORY_CAPACITY - 1);
+        pad = offset + need > SHARED_HISTORY_CAPACITY ? SHARED_HISTORY_CAPACITY - offset : 0;
+        start = current + pad;
+    } while (!atomic_compare_exchange_weak_explicit(&shared_history->reserved, &current, start + need,
+                                                    memory_order_acq_rel, memory_order_relaxed));
+    if (pad) {
+        write_shared_record(current, SHARED_RECORD_PADDING, NULL, pad - sizeof(struct shared_history_record));
+    }
+    write_shared_record(start, SHARED_RECORD_COMMAND, command, length);
+}
+
+// Function for copying the records other sessions appended since the last call into the history array.
+// Readers only load from the mapping, so they can never hold up a writer; a record that was
+// overwritten while it was being copied is detected afterwards and skipped.
+void shared_history_sync(void) {
+    uint64_t head = atomic_load_explicit(&shared_history->reserved, memory_order_acquire);
+    uint64_t pos = shared_history_cursor;
+    int resync = 0;     // Set while looking for the next record boundary after being lapped
+
+    while (pos < head) {
+        if (head > SHARED_HISTORY_CAPACITY && pos < head - SHARED_HISTORY_CAPACITY) {
+            // Writers lapped this session; the oldest surviving bytes may be in the middle of a record.
+            pos = (head - SHARED_HISTORY_CAPACITY + SHARED_HISTORY_ALIGN - 1) & ~(uint64_t)(SHARED_HISTORY_ALIGN - 1);
+            resync = 1;
+            continue;
+        }
+        struct shared_history_record *record =
+            (struct shared_history_record *)(shared_history_area + (pos & (SHARED_HISTORY_CAPACITY - 1)));
+        if (atomic_load_explicit(&record->commit, memory_order_acquire) != pos + 1) {
+            // Either not a record boundary (while resyncing) or a writer that is still filling it in.
+            // A record that stays unfinished while half a lap is written after it is given up on.
+            if (resync || head - pos > SHARED_HISTORY_CAPACITY / 2) {
+                pos += SHARED_HISTORY_ALIGN;
+                resync = 1;
+                continue;
+            }
+            break;
+        }
+        uint32_t length = atomic_load_explicit(&record->length, memory_order_relaxed);
+        uint32_t kind = atomic_load_explicit(&record->kind, memory_order_relaxed);
+        uint64_t size = shared_record_size(length);
+        if (size > SHARED_HISTORY_CAPACITY - (pos & (SHARED_HISTORY_CAPACITY - 1))) {
+            pos += SHARED_HISTORY_ALIGN;    // Torn header from a concurrent overwrite
+            resync = 1;
+            continue;
+        }
+        char command[MAX_COMMAND_LENGTH];
+        uint32_t copy = length < MAX_COMMAND_LENGTH - 1 ? length : MAX_COMMAND_LENGTH - 1;
+        if (kind == SHARED_RECORD_COMMAND) {
+            memcpy(command, record->text, copy);
+        }
+        command[copy] = '\0';
+        atomic_thread_fence(memory_order_acquire);
+        // The bytes at this offset are only reused once a writer reserves position pos + capacity.
+        head = atomic_load_explicit(&shared_history->reserved, memory_order_acquire);
+        if (head > pos + SHARED_HISTORY_CAPACITY) {
+            continue;   // Overwritten while copying; the lap check above moves the cursor forward
+        }
+        if (kind == SHARED_RECORD_COMMAND) {
+            push_history_entry(command);
+        }
+        resync = 0;
+        pos += size;
+    }
+    shared_history_cursor = pos;
+}
+
+// Function for adding a command to the history, either locally or to the shared history file
+void add_to_history(const char *command) {
+    if (shared_history != NULL) {
+        // The local array is filled by shared_history_sync, so this session's command shows up in order.
+        shared_history_append(command);
+        return;
+    }
+    pthread_mutex_lock(&history_lock);
+    push_history_entry(command);
+    pthread_mutex_unlock(&history_lock);
+}
+
+
+// Function for changing the current working directory, returns -1 if it failed
+int change_directory(char **args) {
+    char *path;
+
+    if (args[1] == NULL) {  // If there is no argument to change dir, new directory is default dir. 
+        char *home_directory = getenv("HOME");
+        if (home_directory == NULL) {
+            fprintf(stderr, "HOME environment variable not set\n"); 
+            return -1;
+        }
+        path = home_directory;
+    } else {
+        if (args[1][0] == '/') {
+            // Absolute path is directly assigned.
+            path = args[1];
+        } else {
+            // Relative path
+            char current_directory[MAX_COMMAND_LENGTH];     
+            if (getcwd(current_directory, sizeof(current_directory)) == NULL) {     // retrieving current working directory
+                perror("getcwd");
+                return -1;
+            }
+            path = malloc(strlen(current_directory) + strlen(args[1]) + 2);    // For allocating memory to relative path
+            if (path == NULL) {
+                perror("malloc");
+                return -1;
+            }
+            strcpy(path, current_directory);
+            strcat(path, "/");
+            strcat(path, args[1]);
+        }
+    }
+    int result = chdir(path);
+    if (result != 0) {  // It returns a non-zero value, this means an error is indicated
+        perror("chdir");    
+    } else {
+        setenv("PWD", path, 1);  // For setting the environment variable PWD to the value of path
+    }
+    if (args[1] != NULL && args[1][0] != '/') {     // It frees dynamically allocated memory for relative path.
+        free(path);
+    }
+    return result;
+}
+
+// Lock-free single-producer/single-consumer byte ring that connects two adjacent builtin
+// stages of a pipeline without going through the kernel. The producer only moves head and
+// the consumer only moves tail; a side that has to wait (ring full or empty) spins briefly
+// and then sleeps on the condition variable, which the other side only touches when
+// somebody is actually waiting.
+struct spsc_ring {
+    _Atomic size_t head;            // Bytes written so far, only moved by the producer
+    char head_line[64 - sizeof(size_t)];
+    _Atomic size_t tail;            // Bytes read so far, only moved by the consumer
+    char tail_line[64 - sizeof(size_t)];
+    atomic_int producer_closed;
+    atomic_int consumer_closed;
+    atomic_int waiting;             // Number of sides sleeping on changed
+    atomic_int references;          // Producer and consumer; the last one frees the ring
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    char data[SPSC_RING_SIZE];
+};
+
+struct spsc_ring *spsc_ring_create(void) {
+    struct spsc_ring *ring = malloc(sizeof(*ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->producer_closed, 0);
+    atomic_init(&ring->consumer_closed, 0);
+    atomic_init(&ring->waiting, 0);
+    atomic_init(&ring->references, 2);
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->changed, NULL);
+    return ring;
+}
+
+static void spsc_ring_notify(struct spsc_ring *ring) {
+    atomic_thread_fence(memory_order_seq_cst);  // Pairs with the fence in spsc_ring_wait
+    if (atomic_load_explicit(&ring->waiting, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&ring->lock);
+        pthread_cond_broadcast(&ring->changed);
+        pthread_mutex_unlock(&ring->lock);
+    }
+}
+
+// Function for waiting until the other side moves *index away from seen or closes the ring
+static void spsc_ring_wait(struct spsc_ring *ring, _Atomic size_t *index, size_t seen, atomic_int *closed) {
+    for (int spin = 0; spin < 200; spin++) {
+        if (atomic_load_explicit(index, memory_order_acquire) != seen || atomic_load(closed)) {
+            return;
+        }
+        sched_yield();
+    }
+    pthread_mutex_lock(&ring->lock);
+    atomic_fetch_add(&ring->waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    while (atomic_load_explicit(index, memory_order_acquire) == seen && !atomic_load(closed)) {
+        pthread_cond_wait(&ring->changed, &ring->lock);
+    }
+    atomic_fetch_sub(&ring->waiting, 1);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+// Function for writing a block into the ring, waiting for room when it is full (backpressure)
+int spsc_ring_write(struct spsc_ring *ring, const char *data, size_t size) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while (size > 0) {
+        if (atomic_load_explicit(&ring->consumer_closed, memory_order_acquire)) {
+            errno = EPIPE;  // Same result as writing to a pipe nobody reads
+            return -1;
+        }
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        size_t room = SPSC_RING_SIZE - (head - tail);
+        if (room == 0) {
+            spsc_ring_wait(ring, &ring->tail, tail, &ring->consumer_closed);
+            continue;
+        }
+        size_t offset = head % SPSC_RING_SIZE;
+        size_t chunk = size < room ? size : room;
+        if (chunk > SPSC_RING_SIZE - offset) {
+            chunk = SPSC_RING_SIZE - offset;
+        }
+        memcpy(ring->data + offset, data, chunk);
+        head += chunk;
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+        spsc_ring_notify(ring);
+        data += chunk;
+        size -= chunk;
+    }
+    return 0;
+}
+
+// Function for reading up to size bytes, waiting while the ring is empty; 0 means end of input
+ssize_t spsc_ring_read(struct spsc_ring *ring, char *data, size_t size) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    for (;;) {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (head != tail) {
+            size_t offset = tail % SPSC_RING_SIZE;
+            size_t chunk = head - tail;
+            if (chunk > size) {
+                chunk = size;
+            }
+            if (chunk > SPSC_RING_SIZE - offset) {
+                chunk = SPSC_RING_SIZE - offset;
+            }
+            memcpy(data, ring->data + offset, chunk);
+            atomic_store_explicit(&ring->tail, tail + chunk, memory_order_release);
+            spsc_ring_notify(ring);
+            return chunk;
+        }
+        if (atomic_load_explicit(&ring->producer_closed, memory_order_acquire)) {
+            // The producer publishes its last bytes before closing, so one more look settles it.
+            if (atomic_load_explicit(&ring->head, memory_order_acquire) == tail) {
+                return 0;
+            }
+            continue;
+        }
+        spsc_ring_wait(ring, &ring->head, tail, &ring->producer_closed);
+    }
+}
+
+// Function for closing one side of the ring; the side that closes last frees it
+void spsc_ring_close(struct spsc_ring *ring, int producer) {
+    atomic_store_explicit(producer ? &ring->producer_closed : &ring->consumer_closed, 1, memory_order_release);
+    spsc_ring_notify(ring);
+    if (atomic_fetch_sub(&ring->references, 1) == 1) {
+        pthread_mutex_destroy(&ring->lock);
+        pthread_cond_destroy(&ring->changed);
+        free(ring);
+    }
+}
+
+// Buffered byte stream that builtins read their input from and write their output to.
+// Outside a pipeline it wraps the shell's stdin and stdout, inside one the pipe ends of the
+// stage or the ring shared with a neighbouring builtin stage.
+struct stream {
+    int fd;             // File descriptor the stream reads from or writes to
+    struct spsc_ring *ring;     // When set, used instead of fd
+    int error;          // Set once a write failed (for example the reader went away)
+    size_t length;      // Number of output bytes waiting in buffer
+    char *buffer;       // Output buffer, allocated on first write
+};
+
+void stream_init(struct stream *stream, int fd) {
+    stream->fd = fd;
+    stream->ring = NULL;
+    stream->error = 0;
+    stream->length = 0;
+    stream->buffer = NULL;
+}
+
+// Function for writing a whole block to a file descriptor, retrying short writes
+int write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+void stream_init_ring(struct stream *stream, struct spsc_ring *ring) {
+    stream_init(stream, -1);
+    stream->ring = ring;
+}
+
+// Function for passing a block on to the ring or the file descriptor behind a stream
+static int stream_put(struct stream *stream, const char *data, size_t size) {
+    return stream->ring != NULL ? spsc_ring_write(stream->ring, data, size) : write_all(stream->fd, data, size);
+}
+
+ssize_t stream_read(struct stream *stream, void *data, size_t size) {
+    if (stream->ring != NULL) {
+        return spsc_ring_read(stream->ring, data, size);
+    }
+    ssize_t count;
+    do {
+        count = read(stream->fd, data, size);
+    } while (count < 0 && errno == EINTR);
+    return count;
+}
+
+int stream_flush(struct stream *stream) {
+    if (stream->length > 0 && !stream->error && stream_put(stream, stream->buffer, stream->length) < 0) {
+        stream->error = 1;
+    }
+    stream->length = 0;
+    return stream->error ? -1 : 0;
+}
+
+int stream_write(struct stream *stream, const void *data, size_t size) {
+    if (stream->error) {
+        return -1;
+    }
+    if (stream->buffer == NULL && (stream->buffer = malloc(STREAM_BUFFER_SIZE)) == NULL) {
+        stream->error = stream_put(stream, data, size) < 0;
+        return stream->error ? -1 : 0;
+    }
+    if (stream->length + size > STREAM_BUFFER_SIZE) {
+        if (stream_flush(stream) < 0) {
+            return -1;
+        }
+        if (size >= STREAM_BUFFER_SIZE) {  // Large blocks go straight through
+            stream->error = stream_put(stream, data, size) < 0;
+            return stream->error ? -1 : 0;
+        }
+    }
+    memcpy(stream->buffer + stream->length, data, size);
+    stream->length += size;
+    return 0;
+}
+
+int stream_printf(struct stream *stream, const char *format, ...) {
+    char line[1024];
+    va_list ap;
+    va_start(ap, format);
+    int length = vsnprintf(line, sizeof(line), format, ap);
+    va_end(ap);
+    if (length < 0) {
+        return -1;
+    }
+    if ((size_t)length < sizeof(line)) {
+        return stream_write(stream, line, length);
+    }
+    char *long_line = malloc(length + 1);   // Rare: the line does not fit the stack buffer
+    if (long_line == NULL) {
+        return -1;
+    }
+    va_start(ap, format);
+    vsnprintf(long_line, length + 1, format, ap);
+    va_end(ap);
+    int result = stream_write(stream, long_line, length);
+    free(long_line);
+    return result;
+}
+
+void stream_close(struct stream *stream) {
+    stream_flush(stream);
+    free(stream->buffer);
+    stream->buffer = NULL;
+}
+
+// Fixed-size worker pool (one thread per core) used to run builtins concurrently.
+// Every worker owns a work-stealing deque: it pushes and pops its own tasks at the bottom
+// while idle workers steal from the top of the others. Threads outside the pool submit
+// through an extra injection deque. Pipeline stages may block on their pipes for as long
+// as their neighbours run, so they are only handed to a worker that was reserved for
+// them; when every worker is already running a stage they get a thread of their own.
+struct task_group {
+    atomic_int pending;     // Tasks of the group that have not finished yet
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+};
+
+#define TASK_GROUP_INITIALIZER {0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER}
+
+struct task {
+    void (*run)(void *arg);
+    void *arg;
+    struct task_group *group;   // Group to notify on completion, may be NULL
+    int stage;                  // Set for blocking pipeline stages
+};
+
+struct task_deque {
+    pthread_mutex_t lock;
+    struct task *tasks;         // Circular buffer of capacity entries
+    size_t top, bottom, capacity;
+};
+
+struct thread_pool {
+    int size;                       // Number of workers
+    struct task_deque *deques;      // deques[size] is the injection deque for outside threads
+    struct task_deque stages;       // Pipeline stages waiting for their reserved worker
+    atomic_int free_workers;        // Workers not reserved for a pipeline stage
+    atomic_int queued;              // Tasks waiting in any deque
+    pthread_mutex_t sleep_lock;
+    pthread_cond_t wake;
+};
+
+struct thread_pool pool;
+pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+__thread int pool_worker_index = -1;    // Index of the calling worker, -1 outside the pool
+
+static void deque_init(struct task_deque *deque) {
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->tasks = NULL;
+    deque->top = deque->bottom = deque->capacity = 0;
+}
+
+static int deque_push(struct task_deque *deque, struct task task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom - deque->top == deque->capacity) {
+        size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+        struct task *tasks = malloc(capacity * sizeof(*tasks));
+        if (tasks == NULL) {
+            pthread_mutex_unlock(&deque->lock);
+            return -1;
+        }
+        for (size_t i = deque->top; i < deque->bottom; i++) {
+            tasks[i - deque->top] = deque->tasks[i % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->bottom -= deque->top;
+        deque->top = 0;
+        deque->capacity = capacity;
+    }
+    deque->tasks[deque->bottom++ % deque->capacity] = task;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+// Function for taking a task from the bottom (owner) or the top (thief) of a deque
+static int deque_take(struct task_deque *deque, int from_bottom, struct task *task) {
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom != deque->top) {
+        *task = from_bottom ? deque->tasks[--deque->bottom % deque->capacity]
+                            : deque->tasks[deque->top++ % deque->capacity];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// Function for finding the next task: reserved stages first, then own work, then stealing
+static int pool_find_task(int self, int include_stages, struct task *task) {
+    if (atomic_load_explicit(&pool.queued, memory_order_acquire) == 0) {
+        return 0;
+    }
+    int found = (include_stages && deque_take(&pool.stages, 0, task)) ||
+                (self >= 0 && deque_take(&pool.deques[self], 1, task));
+    for (int i = 1; !found && i <= pool.size + 1; i++) {
+        int victim = (self + i + pool.size + 1) % (pool.size + 1);
+        if (victim != self) {
+            found = deque_take(&pool.deques[victim], 0, task);
+        }
+    }
+    if (found) {
+        atomic_fetch_sub_explicit(&pool.queued, 1, memory_order_relaxed);
+    }
+    return found;
+}
+
+static void pool_run_task(struct task *task) {
+    task->run(task->arg);
+    if (task->stage) {
+        atomic_fetch_add(&pool.free_workers, 1);
+    }
+    struct task_group *group = task->group;
+    if (group != NULL && atomic_fetch_sub(&group->pending, 1) == 1) {
+        pthread_mutex_lock(&group->lock);
+        pthread_cond_broadcast(&group->done);
+        pthread_mutex_unlock(&group->lock);
+    }
+}
+
+static void *pool_worker(void *arg) {
+    pool_worker_index = (int)(intptr_t)arg;
+    for (;;) {
+        struct task task;
+        if (pool_find_task(pool_worker_index, 1, &task)) {
+            pool_run_task(&task);
+            continue;
+        }
+        pthread_mutex_lock(&pool.sleep_lock);
+        while (atomic_load(&pool.queued) == 0) {
+            pthread_cond_wait(&pool.wake, &pool.sleep_lock);
+        }
+        pthread_mutex_unlock(&pool.sleep_lock);
+    }
+    return NULL;
+}
+
+// A forked child has none of the workers, so it starts a pool of its own on first use.
+static void pool_after_fork(void) {
+    pool_once = (pthread_once_t)PTHREAD_ONCE_INIT;
+}
+
+static void pool_register_fork_handler(void) {
+    pthread_atfork(NULL, NULL, pool_after_fork);
+}
+
+static void pool_start(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    pool.size = cores > 0 ? (int)cores : 1;
+    pool.deques = malloc((pool.size + 1) * sizeof(*pool.deques));
+    if (pool.deques == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i <= pool.size; i++) {
+        deque_init(&pool.deques[i]);
+    }
+    deque_init(&pool.stages);
+    atomic_init(&pool.queued, 0);
+    pthread_mutex_init(&pool.sleep_lock, NULL);
+    pthread_cond_init(&pool.wake, NULL);
+    int started = 0;
+    for (int i = 0; i < pool.size; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_worker, (void *)(intptr_t)i) == 0) {
+            pthread_detach(thread);
+            started++;
+        }
+    }
+    // Stages are only reserved against workers that really exist.
+    atomic_init(&pool.free_workers, started);
+    static pthread_once_t fork_handler_once = PTHREAD_ONCE_INIT;
+    pthread_once(&fork_handler_once, pool_register_fork_handler);
+}
+
+static void pool_wake(int everyone) {
+    pthread_mutex_lock(&pool.sleep_lock);
+    if (everyone) {
+        pthread_cond_broadcast(&pool.wake);
+    } else {
+        pthread_cond_signal(&pool.wake);
+    }
+    pthread_mutex_unlock(&pool.sleep_lock);
+}
+
+// Function for queueing a short, non-blocking task that belongs to group
+void thread_pool_submit(struct task_group *group, void (*run)(void *arg), void *arg) {
+    pthread_once(&pool_once, pool_start);
+    struct task task = {run, arg, group, 0};
+    if (group != NULL) {
+        atomic_fetch_add(&group->pending, 1);
+    }
+    int deque = pool_worker_index >= 0 ? pool_worker_index : pool.size;
+    if (deque_push(&pool.deques[deque], task) < 0) {
+        pool_run_task(&task);   // Out of memory: run it right here instead
+        return;
+    }
+    atomic_fetch_add_explicit(&pool.queued, 1, memory_order_release);
+    pool_wake(0);
+}
+
+static void *stage_thread(void *arg) {
+    struct task *task = arg;
+    pool_run_task(task);
+    free(task);
+    return NULL;
+}
+
+// Function for starting a pipeline stage that may block until the other stages make progress
+void thread_pool_run_stage(struct task_group *group, void (*run)(void *arg), void *arg) {
+    pthread_once(&pool_once, pool_start);
+    struct task task = {run, arg, group, 1};
+    if (group != NULL) {
+        atomic_fetch_add(&group->pending, 1);
+    }
+    int free_workers = atomic_load(&pool.free_workers);
+    while (free_workers > 0) {
+        if (atomic_compare_exchange_weak(&pool.free_workers, &free_workers, free_workers - 1)) {
+            if (deque_push(&pool.stages, task) == 0) {
+                atomic_fetch_add_explicit(&pool.queued, 1, memory_order_release);
+                pool_wake(1);   // The stage goes to whichever worker looks first
+                return;
+            }
+            atomic_fetch_add(&pool.free_workers, 1);
+            break;
+        }
+    }
+    // Every worker is busy with a stage: this one gets a thread of its own.
+    struct task *own = malloc(sizeof(*own));
+    pthread_t thread;
+    if (own != NULL) {
+        *own = task;
+        own->stage = 0;
+        if (pthread_create(&thread, NULL, stage_thread, own) == 0) {
+            pthread_detach(thread);
+            return;
+        }
+        free(own);
+    }
+    task.stage = 0;
+    pool_run_task(&task);   // Last resort: run it on the calling thread
+}
+
+// Function for waiting until every task of group has finished, running queued tasks meanwhile
+void task_group_wait(struct task_group *group) {
+    while (atomic_load(&group->pending) > 0) {
+        struct task task;
+        if (pool_find_task(pool_worker_index, 0, &task)) {
+            pool_run_task(&task);
+            continue;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 1000000;    // Re-checking every millisecond for work to help with
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&group->lock);
+        if (atomic_load(&group->pending) > 0) {
+            pthread_cond_timedwait(&group->done, &group->lock, &deadline);
+        }
+        pthread_mutex_unlock(&group->lock);
+    }
+}
+
+// Growable byte buffer used by builtins to collect output or input
+struct byte_buffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+int buffer_reserve(struct byte_buffer *buffer, size_t extra) {
+    if (buffer->length + extra <= buffer->capacity) {
+        return 0;
+    }
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity < buffer->length + extra) {
+        capacity *= 2;
+    }
+    char *data = realloc(buffer->data, capacity);
+    if (data == NULL) {
+        return -1;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+int buffer_append(struct byte_buffer *buffer, const char *data, size_t size) {
+    if (buffer_reserve(buffer, size) < 0) {
+        return -1;
+    }
+    memcpy(buffer->data + buffer->length, data, size);
+    buffer->length += size;
+    return 0;
+}
+
+// Read-only memory mapping of an input file
+struct mapped_file {
+    const char *data;
+    size_t size;
+};
+
+static int map_file(int fd, struct mapped_file *file, int populate) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        errno = ENODEV;
+        return -1;
+    }
+    file->size = st.st_size;
+    file->data = NULL;
+    if (file->size == 0) {
+        return 0;
+    }
+    void *data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE | (populate ? MAP_POPULATE : 0), fd, 0);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    madvise(data, file->size, populate ? MADV_SEQUENTIAL : MADV_RANDOM);
+    file->data = data;
+    return 0;
+}
+
+// Function for mapping a regular file; returns -1 with errno set for anything else (pipes, ttys)
+// so that callers can fall back to reading the file descriptor.
+int map_input_file(int fd, struct mapped_file *file) {
+    return map_file(fd, file, 1);
+}
+
+// Same, but pages are only read in when touched (for callers that look at part of the file)
+int map_input_file_lazy(int fd, struct mapped_file *file) {
+    return map_file(fd, file, 0);
+}
+
+void unmap_input_file(struct mapped_file *file) {
+    if (file->size > 0) {
+        munmap((void *)file->data, file->size);
+    }
+}
+
+// Bump allocator for data that lives exactly as long as one builtin run (input lines,
+// argument vectors). Memory comes in large blocks and is only given back all at once.
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+struct arena {
+    struct arena_block *head;
+    size_t used;            // Bytes handed out, used for memory budgets
+};
+
+void *arena_alloc(struct arena *arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;     // Keeps pointers stored in the arena aligned
+    struct arena_block *block = arena->head;
+    if (block == NULL || block->size - block->used < size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(*block) + block_size);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->next = arena->head;
+        block->size = block_size;
+        block->used = 0;
+        arena->head = block;
+    }
+    void *memory = block->data + block->used;
+    block->used += size;
+    arena->used += size;
+    return memory;
+}
+
+void arena_free(struct arena *arena) {
+    while (arena->head != NULL) {
+        struct arena_block *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+    arena->used = 0;
+}
+
+// Function for handing back everything allocated so far while keeping one block for reuse
+void arena_reset(struct arena *arena) {
+    if (arena->head != NULL) {
+        struct arena_block *keep = arena->head;
+        arena->head = keep->next;
+        arena_free(arena);
+        keep->next = NULL;
+        keep->used = 0;
+        arena->head = keep;
+    }
+    arena->used = 0;
+}
+
+// Function for calling line() on every record of a stream, split at delimiter ('\n' or '\0').
+// The input is read in large blocks; a non-zero return from line() stops the loop.
+int stream_read_lines(struct stream *in, char delimiter, int (*line)(void *context, const char *text, size_t length),
+                      void *context) {
+    struct byte_buffer input = {0};
+    size_t scanned = 0;     // Bytes at the start of input that are known not to hold a delimiter
+    int result = 0;
+    for (;;) {
+        if (buffer_reserve(&input, LINE_READ_SIZE) < 0) {
+            result = -1;
+            break;
+        }
+        ssize_t count = stream_read(in, input.data + input.length, input.capacity - input.length);
+        if (count < 0) {
+            result = -1;
+            break;
+        }
+        if (count == 0) {
+            if (input.length > 0) {
+                result = line(context, input.data, input.length);   // Last record without delimiter
+            }
+            break;
+        }
+        input.length += count;
+        size_t start = 0;
+        const char *end;
+        while ((end = memchr(input.data + scanned, delimiter, input.length - scanned)) != NULL) {
+            size_t stop = end - input.data;
+            if ((result = line(context, input.data + start, stop - start)) != 0) {
+                break;
+            }
+            start = scanned = stop + 1;
+        }
+        if (result != 0) {
+            break;
+        }
+        memmove(input.data, input.data + start, input.length - start);
+        input.length -= start;
+        scanned = input.length;
+    }
+    free(input.data);
+    return result;
+}
+
+// Function for finding needle in haystack. The vector loop compares the first and the last
+// byte of the needle with 16 candidate positions at once and only calls memcmp on positions
+// where both of them match, which skips almost all of the text for real patterns.
+const char *find_substring(const char *haystack, size_t size, const char *needle, size_t length) {
+    if (length == 0) {
+        return haystack;
+    }
+    if (length > size) {
+        return NULL;
+    }
+    if (length == 1) {
+        return memchr(haystack, needle[0], size);
+    }
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[length - 1]);
+    size_t i = 0;
+    for (; i + length - 1 + 16 <= size; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(haystack + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(haystack + i + length - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+                                                        _mm_cmpeq_epi8(last, block_last)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(haystack + i + bit + 1, needle + 1, length - 2) == 0) {
+                return haystack + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    haystack += i;
+    size -= i;
+#endif
+    return memmem(haystack, size, needle, length);
+}
+
+// Settings of one fgrep run
+struct fgrep_options {
+    const char *pattern;
+    size_t length;
+    int invert;         // -v: select the lines that do not match
+    int count_only;     // -c: print the number of selected lines
+    const char *prefix; // File name printed before each line when searching several files
+};
+
+// Function for selecting the lines of [start, end) that start at a line boundary.
+// Matching lines are appended to output (unless only counting); returns the number selected.
+static size_t fgrep_block(const struct fgrep_options *options, const char *start, const char *end,
+                          struct byte_buffer *output) {
+    size_t selected = 0;
+    const char *line = start;
+    while (line < end) {
+        const char *match = find_substring(line, end - line, options->pattern, options->length);
+        const char *match_line = end;   // Start of the line that holds the match
+        const char *match_end = end;    // End of that line, after its newline
+        if (match != NULL) {
+            const char *newline = memrchr(line, '\n', match - line);
+            match_line = newline != NULL ? newline + 1 : line;
+            newline = memchr(match + options->length, '\n', end - (match + options->length));
+            match_end = newline != NULL ? newline + 1 : end;
+        }
+        // Everything before match_line is a run of lines without a match.
+        const char *from = options->invert ? line : match_line;
+        const char *to = options->invert ? match_line : match_end;
+        while (from < to) {
+            const char *newline = memchr(from, '\n', to - from);
+            const char *next = newline != NULL ? newline + 1 : to;
+            selected++;
+            if (!options->count_only) {
+                if (options->prefix != NULL) {
+                    buffer_append(output, options->prefix, strlen(options->prefix));
+                    buffer_append(output, ":", 1);
+                }
+                buffer_append(output, from, next - from);
+                if (newline == NULL) {
+                    buffer_append(output, "\n", 1);     // Last line of the input without a newline
+                }
+            }
+            from = next;
+        }
+        line = match_end;
+    }
+    return selected;
+}
+
+// One slice of a mapped file, searched by a pool worker
+struct fgrep_chunk {
+    const struct fgrep_options *options;
+    const char *start;
+    const char *end;
+    struct byte_buffer output;
+    size_t selected;
+};
+
+static void fgrep_chunk_task(void *arg) {
+    struct fgrep_chunk *chunk = arg;
+    chunk->selected = fgrep_block(chunk->options, chunk->start, chunk->end, &chunk->output);
+}
+
+// Function for searching a mapped file, split on line boundaries across the pool when it is large.
+// The chunks are written out in file order, so the result is the same as a sequential search.
+static size_t fgrep_mapped(const struct fgrep_options *options, const char *data, size_t size, struct stream *out) {
+    size_t chunk_count = (size + FGREP_CHUNK_SIZE - 1) / FGREP_CHUNK_SIZE;
+    struct fgrep_chunk *chunks = chunk_count > 1 ? calloc(chunk_count, sizeof(*chunks)) : NULL;
+    if (chunks == NULL) {
+        struct byte_buffer output = {0};
+        size_t selected = fgrep_block(options, data, data + size, &output);
+        stream_write(out, output.data, output.length);
+        free(output.data);
+        return selected;
+    }
+    struct task_group group = TASK_GROUP_INITIALIZER;
+    const char *start = data;
+    const char *end_of_file = data + size;
+    size_t used = 0;
+    for (size_t c = 0; c < chunk_count && start < end_of_file; c++) {
+        const char *end = start + FGREP_CHUNK_SIZE < end_of_file ? start + FGREP_CHUNK_SIZE : end_of_file;
+        if (end < end_of_file) {
+            const char *newline = memchr(end, '\n', end_of_file - end);
+            end = newline != NULL ? newline + 1 : end_of_file;
+        }
+        chunks[used].options = options;
+        chunks[used].start = start;
+        chunks[used].end = end;
+        thread_pool_submit(&group, fgrep_chunk_task, &chunks[used]);
+        used++;
+        start = end;
+    }
+    task_group_wait(&group);
+    size_t selected = 0;
+    for (size_t c = 0; c < used; c++) {
+        stream_write(out, chunks[c].output.data, chunks[c].output.length);
+        selected += chunks[c].selected;
+        free(chunks[c].output.data);
+    }
+    free(chunks);
+    return selected;
+}
+
+// Function for searching a pipe or terminal, reading it in large blocks instead of through stdio
+static size_t fgrep_stream(const struct fgrep_options *options, struct stream *in, struct stream *out) {
+    struct byte_buffer input = {0};
+    struct byte_buffer output = {0};
+    size_t selected = 0;
+    for (;;) {
+        if (buffer_reserve(&input, FGREP_READ_SIZE) < 0) {
+            perror("fgrep");
+            break;
+        }
+        ssize_t count = stream_read(in, input.data + input.length, input.capacity - input.length);
+        if (count <= 0) {
+            if (count < 0) {
+                perror("fgrep");
+            }
+            break;
+        }
+        input.length += count;
+        // Only complete lines are searched; the partial last line waits for the next read.
+        const char *newline = memrchr(input.data, '\n', input.length);
+        if (newline != NULL) {
+            size_t complete = newline + 1 - input.data;
+            selected += fgrep_block(options, input.data, input.data + complete, &output);
+            memmove(input.data, input.data + complete, input.length - complete);
+            input.length -= complete;
+            if (output.length > 0 && stream_write(out, output.data, output.length) < 0) {
+                break;      // The reader went away
+            }
+            output.length = 0;
+        }
+    }
+    if (input.length > 0) {
+        selected += fgrep_block(options, input.data, input.data + input.length, &output);
+        stream_write(out, output.data, output.length);
+    }
+    free(input.data);
+    free(output.data);
+    return selected;
+}
+
+// Function for the fgrep builtin: fgrep [-v] [-c] pattern [file...]
+// Prints the lines that contain pattern as a fixed string; exit status as in grep.
+int builtin_fgrep(char **args, struct stream *in, struct stream *out) {
+    struct fgrep_options options = {0};
+    int a = 1;
+    for (; args[a] != NULL && args[a][0] == '-' && args[a][1] != '\0'; a++) {
+        for (const char *flag = args[a] + 1; *flag; flag++) {
+            if (*flag == 'v') {
+                options.invert = 1;
+            } else if (*flag == 'c') {
+                options.count_only = 1;
+            } else {
+                fprintf(stderr, "fgrep: invalid option -- '%c'\n", *flag);
+                return 2;
+            }
+        }
+    }
+    if (args[a] == NULL) {
+        fprintf(stderr, "Usage: fgrep [-v] [-c] pattern [file...]\n");
+        return 2;
+    }
+    options.pattern = args[a++];
+    options.length = strlen(options.pattern);
+    int several = args[a] != NULL && args[a + 1] != NULL;
+    size_t total = 0;
+    int failed = 0;
+
+    if (args[a] == NULL) {
+        total = fgrep_stream(&options, in, out);
+        if (options.count_only) {
+            stream_printf(out, "%zu\n", total);
+        }
+    }
+    for (; args[a] != NULL; a++) {
+        int fd = open(args[a], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "fgrep: %s: %s\n", args[a], strerror(errno));
+            failed = 1;
+            continue;
+        }
+        options.prefix = several ? args[a] : NULL;
+        struct mapped_file file;
+        size_t selected;
+        if (map_input_file(fd, &file) == 0) {
+            selected = fgrep_mapped(&options, file.data, file.size, out);
+            unmap_input_file(&file);
+        } else {
+            struct stream file_stream;
+            stream_init(&file_stream, fd);
+            selected = fgrep_stream(&options, &file_stream, out);
+        }
+        close(fd);
+        if (options.count_only) {
+            if (several) {
+                stream_printf(out, "%s:%zu\n", args[a], selected);
+            } else {
+                stream_printf(out, "%zu\n", selected);
+            }
+        }
+        total += selected;
+    }
+    return failed ? 2 : total > 0 ? 0 : 1;
+}
+
+// Line, word and byte counts of one input
+struct wc_counts {
+    size_t lines;
+    size_t words;
+    size_t bytes;
+};
+
+static int wc_is_space(unsigned char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Function for counting a block with plain C; prev_space tells whether the byte before
+// the block was whitespace. Returns the same flag for the last byte of the block.
+static int wc_count_scalar(const unsigned char *data, size_t size, int prev_space, struct wc_counts *counts) {
+    for (size_t i = 0; i < size; i++) {
+        int space = wc_is_space(data[i]);
+        counts->lines += data[i] == '\n';
+        counts->words += prev_space && !space;
+        prev_space = space;
+    }
+    counts->bytes += size;
+    return prev_space;
+}
+
+#ifdef __SSE2__
+// Function for counting 16 bytes per step: newlines and whitespace become bit masks, and a
+// word starts at every non-space byte whose predecessor is a space, so both counts are popcounts.
+__attribute__((target("popcnt")))
+static int wc_count_sse2(const unsigned char *data, size_t size, int prev_space, struct wc_counts *counts) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i blank = _mm_set1_epi8(' ');
+    const __m128i low = _mm_set1_epi8('\t');
+    const __m128i high = _mm_set1_epi8('\r');
+    size_t lines = 0, words = 0, i = 0;
+    unsigned carry = prev_space;
+    for (; i + 16 <= size; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i in_range = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(block, low), block),
+                                         _mm_cmpeq_epi8(_mm_min_epu8(block, high), block));
+        unsigned space = _mm_movemask_epi8(_mm_or_si128(in_range, _mm_cmpeq_epi8(block, blank)));
+        unsigned lf = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+        unsigned starts = ~space & ((space << 1) | carry) & 0xffff;
+        lines += __builtin_popcount(lf);
+        words += __builtin_popcount(starts);
+        carry = space >> 15;
+    }
+    counts->lines += lines;
+    counts->words += words;
+    counts->bytes += i;
+    return wc_count_scalar(data + i, size - i, carry, counts);
+}
+
+// The same kernel 32 bytes at a time, chosen at run time on CPUs with AVX2
+__attribute__((target("avx2,popcnt")))
+static int wc_count_avx2(const unsigned char *data, size_t size, int prev_space, struct wc_counts *counts) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i blank = _mm256_set1_epi8(' ');
+    const __m256i low = _mm256_set1_epi8('\t');
+    const __m256i high = _mm256_set1_epi8('\r');
+    size_t lines = 0, words = 0, i = 0;
+    uint32_t carry = prev_space;
+    for (; i + 32 <= size; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i in_range = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(block, low), block),
+                                            _mm256_cmpeq_epi8(_mm256_min_epu8(block, high), block));
+        uint32_t space = _mm256_movemask_epi8(_mm256_or_si256(in_range, _mm256_cmpeq_epi8(block, blank)));
+        uint32_t lf = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+        uint32_t starts = ~space & ((space << 1) | carry);
+        lines += __builtin_popcount(lf);
+        words += __builtin_popcount(starts);
+        carry = space >> 31;
+    }
+    counts->lines += lines;
+    counts->words += words;
+    counts->bytes += i;
+    return wc_count_sse2(data + i, size - i, carry, counts);
+}
+#endif
+
+// Function for counting a block with the widest kernel the CPU supports
+int wc_count_block(const char *data, size_t size, int prev_space, struct wc_counts *counts) {
+#ifdef __SSE2__
+    static int use_avx2 = -1;
+    if (use_avx2 < 0) {
+        __builtin_cpu_init();
+        use_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+    }
+    if (use_avx2) {
+        return wc_count_avx2((const unsigned char *)data, size, prev_space, counts);
+    }
+    return wc_count_sse2((const unsigned char *)data, size, prev_space, counts);
+#else
+    return wc_count_scalar((const unsigned char *)data, size, prev_space, counts);
+#endif
+}
+
+// A slice of a mapped file (or a whole small file) counted by one pool task
+struct wc_chunk {
+    const char *data;
+    size_t size;
+    int prev_space;     // Whether the byte before the slice is whitespace
+    struct wc_counts counts;
+};
+
+static void wc_chunk_task(void *arg) {
+    struct wc_chunk *chunk = arg;
+    wc_count_block(chunk->data, chunk->size, chunk->prev_space, &chunk->counts);
+}
+
+// Function for counting a pipe, terminal or ring in large blocks
+static int wc_count_stream(struct stream *in, struct wc_counts *counts) {
+    char *block = malloc(WC_READ_SIZE);
+    if (block == NULL) {
+        return -1;
+    }
+    int prev_space = 1;
+    ssize_t count;
+    while ((count = stream_read(in, block, WC_READ_SIZE)) > 0) {
+        prev_space = wc_count_block(block, count, prev_space, counts);
+    }
+    free(block);
+    return count < 0 ? -1 : 0;
+}
+
+static void wc_print(struct stream *out, const struct wc_counts *counts, int show_lines, int show_words,
+                     int show_bytes, int width, const char *name) {
+    const char *separator = "";
+    if (show_lines) {
+        stream_printf(out, "%*zu", width, counts->lines);
+        separator = " ";
+    }
+    if (show_words) {
+        stream_printf(out, "%s%*zu", separator, width, counts->words);
+        separator = " ";
+    }
+    if (show_bytes) {
+        stream_printf(out, "%s%*zu", separator, width, counts->bytes);
+    }
+    stream_printf(out, name != NULL ? " %s\n" : "\n", name);
+}
+
+// Function for the wc builtin: wc [-l] [-w] [-c] [file...]
+// Files are counted in parallel: small files as one task each, large mapped files in chunks.
+int builtin_wc(char **args, struct stream *in, struct stream *out) {
+    int show_lines = 0, show_words = 0, show_bytes = 0;
+    int a = 1;
+    for (; args[a] != NULL && args[a][0] == '-' && args[a][1] != '\0'; a++) {
+        for (const char *flag = args[a] + 1; *flag; flag++) {
+            if (*flag == 'l') {
+                show_lines = 1;
+            } else if (*flag == 'w') {
+                show_words = 1;
+            } else if (*flag == 'c') {
+                show_bytes = 1;
+            } else {
+                fprintf(stderr, "wc: invalid option -- '%c'\n", *flag);
+                return 1;
+            }
+        }
+    }
+    if (!show_lines && !show_words && !show_bytes) {
+        show_lines = show_words = show_bytes = 1;
+    }
+    int shown = show_lines + show_words + show_bytes;
+
+    if (args[a] == NULL) {
+        struct wc_counts counts = {0, 0, 0};
+        if (wc_count_stream(in, &counts) < 0) {
+            perror("wc");
+            return 1;
+        }
+        wc_print(out, &counts, show_lines, show_words, show_bytes, shown == 1 ? 1 : 7, NULL);
+        return 0;
+    }
+
+    int file_count = 0;
+    while (args[a + file_count] != NULL) {
+        file_count++;
+    }
+    struct mapped_file *files = calloc(file_count, sizeof(*files));
+    struct wc_counts *counts = calloc(file_count, sizeof(*counts));
+    int *status = calloc(file_count, sizeof(*status));     // 0 mapped, 1 streamed, -1 failed
+    size_t chunk_count = 0;
+    if (files == NULL || counts == NULL || status == NULL) {
+        perror("wc");
+        free(files);
+        free(counts);
+        free(status);
+        return 1;
+    }
+    for (int f = 0; f < file_count; f++) {
+        int fd = open(args[a + f], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "wc: %s: %s\n", args[a + f], strerror(errno));
+            status[f] = -1;
+            continue;
+        }
+        if (map_input_file(fd, &files[f]) == 0) {
+            chunk_count += files[f].size / WC_CHUNK_SIZE + 1;
+        } else {
+            // Pipes and devices are read right here, in order.
+            struct stream file_stream;
+            stream_init(&file_stream, fd);
+            status[f] = 1;
+            if (wc_count_stream(&file_stream, &counts[f]) < 0) {
+                fprintf(stderr, "wc: %s: %s\n", args[a + f], strerror(errno));
+                status[f] = -1;
+            }
+        }
+        close(fd);
+    }
+
+    struct wc_chunk *chunks = calloc(chunk_count ? chunk_count : 1, sizeof(*chunks));
+    int *chunk_file = calloc(chunk_count ? chunk_count : 1, sizeof(*chunk_file));
+    struct task_group group = TASK_GROUP_INITIALIZER;
+    size_t used = 0;
+    if (chunks == NULL || chunk_file == NULL) {
+        perror("wc");
+        chunk_count = 0;
+    }
+    for (int f = 0; f < file_count && chunk_count > 0; f++) {
+        if (status[f] != 0) {
+            continue;
+        }
+        for (size_t offset = 0; offset == 0 || offset < files[f].size; offset += WC_CHUNK_SIZE) {
+            size_t size = files[f].size - offset < WC_CHUNK_SIZE ? files[f].size - offset : WC_CHUNK_SIZE;
+            chunks[used].data = files[f].data + offset;
+            chunks[used].size = size;
+            chunks[used].prev_space = offset == 0 || wc_is_space(files[f].data[offset - 1]);
+            chunk_file[used] = f;
+            thread_pool_submit(&group, wc_chunk_task, &chunks[used]);
+            used++;
+        }
+    }
+    task_group_wait(&group);
+    for (size_t c = 0; c < used; c++) {
+        struct wc_counts *total = &counts[chunk_file[c]];
+        total->lines += chunks[c].counts.lines;
+        total->words += chunks[c].counts.words;
+        total->bytes += chunks[c].counts.bytes;
+    }
+
+    // Like coreutils, columns are as wide as the total byte count (at least 7 when a pipe is read).
+    struct wc_counts total = {0, 0, 0};
+    int width = 1, failed = 0, streamed = 0;
+    for (int f = 0; f < file_count; f++) {
+        total.lines += counts[f].lines;
+        total.words += counts[f].words;
+        total.bytes += counts[f].bytes;
+        streamed |= status[f] == 1;
+    }
+    for (size_t largest = total.bytes; largest >= 10; largest /= 10) {
+        width++;
+    }
+    if (streamed && shown > 1 && width < 7) {
+        width = 7;
+    }
+    if (shown == 1 && file_count == 1) {
+        width = 1;
+    }
+    for (int f = 0; f < file_count; f++) {
+        if (status[f] < 0) {
+            failed = 1;
+            continue;
+        }
+        wc_print(out, &counts[f], show_lines, show_words, show_bytes, width, args[a + f]);
+        if (status[f] == 0) {
+            unmap_input_file(&files[f]);
+        }
+    }
+    if (file_count > 1) {
+        wc_print(out, &total, show_lines, show_words, show_bytes, width, "total");
+    }
+    free(chunks);
+    free(chunk_file);
+    free(files);
+    free(counts);
+    free(status);
+    return failed;
+}
+
+// Settings and state of one sort run
+struct sort_options {
+    int numeric;            // -n: compare the leading number of the key
+    int reverse;            // -r
+    int unique;             // -u: output only the first of lines with equal keys
+    char separator;         // -t: field separator, 0 for runs of blanks
+    int key_start;          // -k: first field of the key (1-based), 0 for the whole line
+    int key_end;            // Last field of the key, 0 for the end of the line
+    size_t budget;          // -S: bytes of input kept in memory before a run is spilled
+};
+
+struct sort_record {
+    const char *line;
+    size_t length;
+    const char *key;
+    size_t key_length;
+    double number;         // Value of the key with -n
+    size_t index;          // Position in the input, so that -u keeps the first of equal lines
+};
+
+struct sort_state {
+    struct sort_options options;
+    struct arena arena;                 // Text of the lines of the current batch
+    struct sort_record *records;
+    size_t count;
+    size_t capacity;
+    size_t lines_read;
+    FILE *runs[SORT_MAX_RUNS];          // Sorted runs spilled to temporary files
+    int run_count;
+};
+
+static int sort_blank(char c) {
+    return c == ' ' || c == '\t';
+}
+
+// Function for finding where field (1-based) starts; like sort(1), blanks before a field belong to it
+static const char *sort_field_start(const struct sort_options *options, const char *line, const char *end, int field) {
+    const char *p = line;
+    for (int f = 1; f < field && p < end; f++) {
+        if (options->separator) {
+            const char *separator = memchr(p, options->separator, end - p);
+            p = separator != NULL ? separator + 1 : end;
+        } else {
+            while (p < end && sort_blank(*p)) {
+                p++;
+            }
+            while (p < end && !sort_blank(*p)) {
+                p++;
+            }
+        }
+    }
+    return p;
+}
+
+static const char *sort_field_end(const struct sort_options *options, const char *line, const char *end, int field) {
+    const char *p = sort_field_start(options, line, end, field);
+    if (options->separator) {
+        const char *separator = memchr(p, options->separator, end - p);
+        return separator != NULL ? separator : end;
+    }
+    while (p < end && sort_blank(*p)) {
+        p++;
+    }
+    while (p < end && !sort_blank(*p)) {
+        p++;
+    }
+    return p;
+}
+
+// Function for reading the number at the start of a key the way sort -n does (no exponents)
+static double sort_parse_number(const char *p, const char *end) {
+    while (p < end && sort_blank(*p)) {
+        p++;
+    }
+    int negative = p < end && *p == '-';
+    p += negative;
+    double value = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        value = value * 10 + (*p - '0');
+    }
+    if (p < end && *p == '.') {
+        double scale = 0.1;
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, scale /= 10) {
+            value += (*p - '0') * scale;
+        }
+    }
+    return negative && value != 0 ? -value : value;
+}
+
+static void sort_make_record(const struct sort_options *options, const char *line, size_t length,
+                             struct sort_record *record) {
+    const char *end = line + length;
+    record->line = line;
+    record->length = length;
+    record->key = line;
+    record->key_length = length;
+    if (options->key_start > 0) {
+        const char *key = sort_field_start(options, line, end, options->key_start);
+        const char *key_end = options->key_end > 0 ? sort_field_end(options, line, end, options->key_end) : end;
+        record->key = key;
+        record->key_length = key_end > key ? key_end - key : 0;
+    }
+    record->number = options->numeric ? sort_parse_number(record->key, record->key + record->key_length) : 0;
+}
+
+static int sort_compare_bytes(const char *a, size_t a_length, const char *b, size_t b_length) {
+    int result = memcmp(a, b, a_length < b_length ? a_length : b_length);
+    if (result != 0) {
+        return result;
+    }
+    return a_length < b_length ? -1 : a_length > b_length;
+}
+
+// Function for comparing the keys only, which is what -u uses to decide on duplicates
+static int sort_compare_keys(const struct sort_options *options, const struct sort_record *a, const struct sort_record *b) {
+    if (options->numeric) {
+        return a->number < b->number ? -1 : a->number > b->number;
+    }
+    return sort_compare_bytes(a->key, a->key_length, b->key, b->key_length);
+}
+
+// Function for the complete ordering (before -r): equal keys fall back to the whole line,
+// or with -u to the input order
+static int sort_compare_ascending(const struct sort_options *options, const struct sort_record *a, const struct sort_record *b) {
+    int result = sort_compare_keys(options, a, b);
+    if (result == 0 && !options->unique) {
+        result = sort_compare_bytes(a->line, a->length, b->line, b->length);
+    } else if (result == 0) {
+        result = a->index < b->index ? -1 : a->index > b->index;
+    }
+    return result;
+}
+
+static int sort_compare_records(const void *a, const void *b, void *options) {
+    return sort_compare_ascending(options, a, b);
+}
+
+static int sort_compare_lines(const void *a, const void *b, void *unused) {
+    const struct sort_record *left = a, *right = b;
+    (void)unused;
+    return sort_compare_bytes(left->line, left->length, right->line, right->length);
+}
+
+// Function for sorting records by their key bytes with a most-significant-byte radix sort.
+// All records passed in share the first depth bytes of their keys. A byte every key has in
+// common is skipped in a loop rather than a nested pass, and past SORT_RADIX_MAX_LEVELS nested
+// passes qsort takes over, so long shared prefixes cannot exhaust the stack.
+static void sort_radix_keys(const struct sort_options *options, struct sort_record *records, struct sort_record *scratch,
+                            size_t count, size_t depth, int level) {
+    if (count < SORT_RADIX_CUTOFF || level >= SORT_RADIX_MAX_LEVELS) {
+        qsort_r(records, count, sizeof(*records), sort_compare_records, (void *)options);
+        return;
+    }
+    size_t counts[257];           // Bucket 0 holds the keys that end at depth
+    while (1) {
+        memset(counts, 0, sizeof(counts));
+        for (size_t i = 0; i < count; i++) {
+            counts[depth < records[i].key_length ? (unsigned char)records[i].key[depth] + 1 : 0]++;
+        }
+        const struct sort_record *first = &records[0];
+        int shared = depth < first->key_length ? (unsigned char)first->key[depth] + 1 : 0;
+        if (shared == 0 || counts[shared] != count) {
+            break;
+        }
+        depth++;    // Every key has the same byte here
+    }
+    size_t offsets[257];
+    size_t offset = 0;
+    for (int b = 0; b < 257; b++) {
+        offsets[b] = offset;
+        offset += counts[b];
+    }
+    for (size_t i = 0; i < count; i++) {
+        int b = depth < records[i].key_length ? (unsigned char)records[i].key[depth] + 1 : 0;
+        scratch[offsets[b]++] = records[i];
+    }
+    memcpy(records, scratch, count * sizeof(*records));
+    // Equal keys are only ordered further by the whole line.
+    if (counts[0] > 1 && !options->unique) {
+        qsort_r(records, counts[0], sizeof(*records), sort_compare_lines, NULL);
+    }
+    offset = counts[0];
+    for (int b = 1; b < 257; b++) {
+        if (counts[b] > 1) {
+            sort_radix_keys(options, records + offset, scratch, counts[b], depth + 1, level + 1);
+        }
+        offset += counts[b];
+    }
+}
+
+// Function for mapping a double to an unsigned integer with the same ordering
+static uint64_t sort_number_bits(double number) {
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return bits >> 63 ? ~bits : bits | (1ULL << 63);
+}
+
+// Function for sorting records by numeric key: a least-significant-byte radix sort of the
+// key's bits, after which only runs of equal numbers need the whole-line comparison.
+static void sort_radix_numbers(const struct sort_options *options, struct sort_record *records,
+                               struct sort_record *scratch, size_t count) {
+    if (count < SORT_RADIX_CUTOFF) {
+        qsort_r(records, count, sizeof(*records), sort_compare_records, (void *)options);
+        return;
+    }
+    struct sort_record *from = records, *to = scratch;
+    for (int shift = 0; shift < 64; shift += 8) {
+        size_t counts[256] = {0};
+        for (size_t i = 0; i < count; i++) {
+            counts[(sort_number_bits(from[i].number) >> shift) & 0xff]++;
+        }
+        if (counts[(sort_number_bits(from[0].number) >> shift) & 0xff] == count) {
+            continue;   // Every key has the same byte here
+        }
+        size_t offset = 0;
+        for (int b = 0; b < 256; b++) {
+            size_t next = offset + counts[b];
+            counts[b] = offset;
+            offset = next;
+        }
+        for (size_t i = 0; i < count; i++) {
+            to[counts[(sort_number_bits(from[i].number) >> shift) & 0xff]++] = from[i];
+        }
+        struct sort_record *swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != records) {
+        memcpy(records, from, count * sizeof(*records));
+    }
+    if (!options->unique) {
+        for (size_t start = 0, end; start < count; start = end) {
+            for (end = start + 1; end < count && records[end].number == records[start].number; end++) {
+            }
+            if (end - start > 1) {
+                qsort_r(records + start, end - start, sizeof(*records), sort_compare_lines, NULL);
+            }
+        }
+    }
+}
+
+// A range of the current batch sorted by one pool task
+struct sort_chunk {
+    const struct sort_options *options;
+    struct sort_record *records;
+    size_t count;
+};
+
+static void sort_chunk_task(void *arg) {
+    struct sort_chunk *chunk = arg;
+    struct sort_record *scratch = malloc(chunk->count * sizeof(*scratch) + 1);
+    if (scratch == NULL) {
+        qsort_r(chunk->records, chunk->count, sizeof(*chunk->records), sort_compare_records, (void *)chunk->options);
+    } else if (chunk->options->numeric) {
+        sort_radix_numbers(chunk->options, chunk->records, scratch, chunk->count);
+    } else {
+        sort_radix_keys(chunk->options, chunk->records, scratch, chunk->count, 0, 0);
+    }
+    free(scratch);
+    if (chunk->options->unique && chunk->count > 0) {
+        // Equal keys are in input order now, so keeping the first of each run matches sort -u.
+        size_t kept = 1;
+        for (size_t i = 1; i < chunk->count; i++) {
+            if (sort_compare_keys(chunk->options, &chunk->records[kept - 1], &chunk->records[i]) != 0) {
+                chunk->records[kept++] = chunk->records[i];
+            }
+        }
+        chunk->count = kept;
+    }
+    if (chunk->options->reverse) {
+        for (size_t i = 0, j = chunk->count; i + 1 < j; i++, j--) {
+            struct sort_record swap = chunk->records[i];
+            chunk->records[i] = chunk->records[j - 1];
+            chunk->records[j - 1] = swap;
+        }
+    }
+}
+
+// One input of the k-way merge: a sorted range in memory or a spilled run
+struct merge_source {
+    struct sort_record current;
+    struct sort_record *next;
+    struct sort_record *end;
+    FILE *run;
+    char *line;
+    size_t line_capacity;
+};
+
+static int merge_source_advance(const struct sort_options *options, struct merge_source *source) {
+    if (source->run == NULL) {
+        if (source->next == source->end) {
+            return 0;
+        }
+        source->current = *source->next++;
+        return 1;
+    }
+    ssize_t length = getline(&source->line, &source->line_capacity, source->run);
+    if (length <= 0) {
+        return 0;
+    }
+    sort_make_record(options, source->line, length - 1, &source->current);     // Runs always end lines with '\n'
+    source->current.index = 0;
+    return 1;
+}
+
+// Sources are ordered as their input was read, which decides between equal keys with -u.
+static int merge_less(const struct sort_options *options, const struct merge_source *a, const struct merge_source *b) {
+    int result = options->unique ? sort_compare_keys(options, &a->current, &b->current)
+                                 : sort_compare_ascending(options, &a->current, &b->current);
+    if (result == 0) {
+        return a < b;
+    }
+    return options->reverse ? result > 0 : result < 0;
+}
+
+static void merge_sift_down(const struct sort_options *options, struct merge_source **heap, int size, int i) {
+    for (;;) {
+        int smallest = i, left = 2 * i + 1, right = left + 1;
+        if (left < size && merge_less(options, heap[left], heap[smallest])) {
+            smallest = left;
+        }
+        if (right < size && merge_less(options, heap[right], heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        struct merge_source *swap = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = swap;
+        i = smallest;
+    }
+}
+
+// Function for merging sorted sources into out with a binary heap, dropping duplicates with -u
+static int sort_merge(const struct sort_options *options, struct merge_source *sources, int source_count, struct stream *out) {
+    struct merge_source **heap = malloc(source_count * sizeof(*heap) + 1);
+    struct byte_buffer last = {0};     // Copy of the last line written, for -u
+    struct sort_record last_record;
+    int have_last = 0, size = 0;
+    if (heap == NULL) {
+        return -1;
+    }
+    for (int s = 0; s < source_count; s++) {
+        if (merge_source_advance(options, &sources[s])) {
+            heap[size++] = &sources[s];
+        }
+    }
+    for (int i = size / 2 - 1; i >= 0; i--) {
+        merge_sift_down(options, heap, size, i);
+    }
+    while (size > 0) {
+        struct merge_source *top = heap[0];
+        if (!options->unique || !have_last || sort_compare_keys(options, &last_record, &top->current) != 0) {
+            if (stream_write(out, top->current.line, top->current.length) < 0 || stream_write(out, "\n", 1) < 0) {
+                break;
+            }
+            if (options->unique) {
+                last.length = 0;
+                buffer_append(&last, top->current.line, top->current.length);
+                sort_make_record(options, last.data, last.length, &last_record);
+                have_last = 1;
+            }
+        }
+        if (!merge_source_advance(options, top)) {
+            heap[0] = heap[--size];
+        }
+        merge_sift_down(options, heap, size, 0);
+    }
+    free(last.data);
+    free(heap);
+    return out->error ? -1 : 0;
+}
+
+// Function for sorting the current batch in parallel chunks and merging them into out
+static int sort_flush_batch(struct sort_state *state, struct stream *out, FILE **extra_runs, int extra_count) {
+    pthread_once(&pool_once, pool_start);
+    size_t chunk_count = state->count / SORT_MIN_CHUNK;
+    if (chunk_count > (size_t)pool.size) {
+        chunk_count = pool.size;
+    }
+    if (chunk_count == 0) {
+        chunk_count = 1;
+    }
+    struct sort_chunk chunks[chunk_count];
+    struct merge_source sources[extra_count + chunk_count];
+    struct task_group group = TASK_GROUP_INITIALIZER;
+    size_t start = 0;
+    memset(sources, 0, sizeof(sources));
+    for (size_t c = 0; c < chunk_count; c++) {
+        size_t end = state->count * (c + 1) / chunk_count;
+        chunks[c].options = &state->options;
+        chunks[c].records = state->records + start;
+        chunks[c].count = end - start;
+        thread_pool_submit(&group, sort_chunk_task, &chunks[c]);
+        start = end;
+    }
+    task_group_wait(&group);
+    // Spilled runs hold earlier input than the current batch, so they come first.
+    for (int r = 0; r < extra_count; r++) {
+        rewind(extra_runs[r]);
+        sources[r].run = extra_runs[r];
+    }
+    for (size_t c = 0; c < chunk_count; c++) {
+        sources[extra_count + c].next = chunks[c].records;
+        sources[extra_count + c].end = chunks[c].records + chunks[c].count;
+    }
+    int result = sort_merge(&state->options, sources, chunk_count + extra_count, out);
+    for (size_t s = 0; s < chunk_count + extra_count; s++) {
+        free(sources[s].line);
+    }
+    return result;
+}
+
+// Function for writing the current batch to a temporary file once it exceeds the memory budget
+static int sort_spill(struct sort_state *state) {
+    if (state->run_count == SORT_MAX_RUNS) {
+        // Too many runs: fold the existing ones into the new run as well.
+        FILE *merged = tmpfile();
+        struct stream run_stream;
+        if (merged == NULL) {
+            return -1;
+        }
+        stream_init(&run_stream, fileno(merged));
+        int result = sort_flush_batch(state, &run_stream, state->runs, state->run_count);
+        stream_close(&run_stream);
+        for (int r = 0; r < state->run_count; r++) {
+            fclose(state->runs[r]);
+        }
+        state->runs[0] = merged;
+        state->run_count = 1;
+        state->count = 0;
+        arena_free(&state->arena);
+        return result;
+    }
+    FILE *run = tmpfile();
+    if (run == NULL) {
+        return -1;
+    }
+    struct stream run_stream;
+    stream_init(&run_stream, fileno(run));
+    int result = sort_flush_batch(state, &run_stream, NULL, 0);
+    stream_close(&run_stream);
+    state->runs[state->run_count++] = run;
+    state->count = 0;
+    arena_free(&state->arena);
+    return result;
+}
+
+static int sort_add_line(void *context, const char *text, size_t length) {
+    struct sort_state *state = context;
+    if (state->count == state->capacity) {
+        size_t capacity = state->capacity ? state->capacity * 2 : 4096;
+        struct sort_record *records = realloc(state->records, capacity * sizeof(*records));
+        if (records == NULL) {
+            return -1;
+        }
+        state->records = records;
+        state->capacity = capacity;
+    }
+    char *line = arena_alloc(&state->arena, length + 1);
+    if (line == NULL) {
+        return -1;
+    }
+    memcpy(line, text, length);
+    sort_make_record(&state->options, line, length, &state->records[state->count]);
+    state->records[state->count++].index = state->lines_read++;
+    if (state->arena.used + state->count * sizeof(struct sort_record) > state->options.budget) {
+        return sort_spill(state);
+    }
+    return 0;
+}
+
+// Function for reading a size such as 64M for -S
+static size_t sort_parse_size(const char *text) {
+    char *end;
+    double size = strtod(text, &end);
+    switch (*end) {
+        case 'k': case 'K': size *= 1024; break;
+        case 'm': case 'M': size *= 1024 * 1024; break;
+        case 'g': case 'G': size *= 1024.0 * 1024 * 1024; break;
+        default: break;
+    }
+    return size > 0 ? (size_t)size : 0;
+}
+
+// Function for the sort builtin: sort [-n] [-r] [-u] [-t sep] [-k start[,end]] [-S size] [file...]
+// Lines go into an arena; when it outgrows the memory budget the batch is sorted in parallel
+// chunks and spilled to a temporary file, and at the end all runs are merged.
+int builtin_sort(char **args, struct stream *in, struct stream *out) {
+    struct sort_state state;
+    memset(&state, 0, sizeof(state));
+    state.options.budget = SORT_DEFAULT_BUDGET;
+    int a = 1;
+    for (; args[a] != NULL && args[a][0] == '-' && args[a][1] != '\0'; a++) {
+        for (const char *flag = args[a] + 1; *flag; flag++) {
+            if (*flag == 'n') {
+                state.options.numeric = 1;
+            } else if (*flag == 'r') {
+                state.options.reverse = 1;
+            } else if (*flag == 'u') {
+                state.options.unique = 1;
+            } else if (*flag == 't' || *flag == 'k' || *flag == 'S') {
+                // The value is either the rest of this word or the next word.
+                const char *value = flag[1] != '\0' ? flag + 1 : args[++a];
+                if (value == NULL) {
+                    fprintf(stderr, "sort: option requires an argument -- '%c'\n", *flag);
+                    return 2;
+                }
+                if (*flag == 't') {
+                    state.options.separator = value[0];
+                } else if (*flag == 'k') {
+                    char *end;
+                    state.options.key_start = strtol(value, &end, 10);
+                    state.options.key_end = *end == ',' ? strtol(end + 1, NULL, 10) : 0;
+                    if (state.options.key_start < 1) {
+                        fprintf(stderr, "sort: invalid key '%s'\n", value);
+                        return 2;
+                    }
+                } else if ((state.options.budget = sort_parse_size(value)) == 0) {
+                    fprintf(stderr, "sort: invalid buffer size '%s'\n", value);
+                    return 2;
+                }
+                break;
+            } else {
+                fprintf(stderr, "sort: invalid option -- '%c'\n", *flag);
+                return 2;
+            }
+        }
+    }
+
+    int failed = 0;
+    if (args[a] == NULL) {
+        failed = stream_read_lines(in, '\n', sort_add_line, &state) != 0;
+    }
+    for (; args[a] != NULL && !failed; a++) {
+        int fd = open(args[a], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "sort: %s: %s\n", args[a], strerror(errno));
+            failed = 1;
+            break;
+        }
+        struct stream file_stream;
+        stream_init(&file_stream, fd);
+        failed = stream_read_lines(&file_stream, '\n', sort_add_line, &state) != 0;
+        close(fd);
+    }
+    if (failed) {
+        if (errno != 0) {
+            perror("sort");
+        }
+    } else if (sort_flush_batch(&state, out, state.runs, state.run_count) < 0 && !out->error) {
+        perror("sort");
+        failed = 1;
+    }
+    for (int r = 0; r < state.run_count; r++) {
+        fclose(state.runs[r]);
+    }
+    arena_free(&state.arena);
+    free(state.records);
+    return failed ? 2 : 0;
+}
+
+// Function for hashing a byte string, eight bytes per step
+uint64_t hash_bytes(const char *data, size_t length) {
+    const uint64_t multiplier = 0x9e3779b97f4a7c15ULL;
+    uint64_t hash = length * multiplier;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * multiplier;
+        hash ^= hash >> 29;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, length - i);
+    hash = (hash ^ tail) * multiplier;
+    hash ^= hash >> 32;
+    return hash * multiplier ^ (hash >> 29);
+}
+
+// Function for finding field (1-based) of a line like awk does: fields are split at every
+// separator, or at runs of blanks when separator is 0. Returns NULL if the line is shorter.
+const char *line_field(const char *line, size_t length, char separator, int field, size_t *field_length) {
+    const char *p = line, *end = line + length;
+    for (int f = 1; ; f++) {
+        if (!separator) {
+            while (p < end && (*p == ' ' || *p == '\t')) {
+                p++;
+            }
+            if (p == end) {
+                return NULL;
+            }
+        }
+        const char *stop = p;
+        if (separator) {
+            const char *found = memchr(p, separator, end - p);
+            stop = found != NULL ? found : end;
+        } else {
+            while (stop < end && *stop != ' ' && *stop != '\t') {
+                stop++;
+            }
+        }
+        if (f == field) {
+            *field_length = stop - p;
+            return p;
+        }
+        if (stop == end) {
+            return NULL;
+        }
+        p = separator ? stop + 1 : stop;
+    }
+}
+
+// Open-addressing (linear probing) table of key counts; the keys live in the table's arena
+struct count_entry {
+    uint64_t hash;
+    const char *key;       // NULL marks an empty slot
+    size_t length;
+    size_t count;
+};
+
+struct count_table {
+    struct count_entry *entries;
+    size_t capacity;        // Always a power of two
+    size_t used;
+    struct arena keys;
+    struct count_table *next_free;
+};
+
+static int count_table_grow(struct count_table *table) {
+    size_t capacity = table->capacity ? table->capacity * 2 : 1024;
+    struct count_entry *entries = calloc(capacity, sizeof(*entries));
+    if (entries == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < table->capacity; i++) {
+        struct count_entry *entry = &table->entries[i];
+        if (entry->key != NULL) {
+            size_t slot = entry->hash & (capacity - 1);
+            while (entries[slot].key != NULL) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            entries[slot] = *entry;
+        }
+    }
+    free(table->entries);
+    table->entries = entries;
+    table->capacity = capacity;
+    return 0;
+}
+
+// Function for adding amount to the count of a key, copying the key into the arena when it is new
+static int count_table_add(struct count_table *table, const char *key, size_t length, uint64_t hash, size_t amount) {
+    if ((table->used + 1) * 4 > table->capacity * 3 && count_table_grow(table) < 0) {
+        return -1;
+    }
+    size_t slot = hash & (table->capacity - 1);
+    for (;;) {
+        struct count_entry *entry = &table->entries[slot];
+        if (entry->key == NULL) {
+            char *copy = arena_alloc(&table->keys, length + 1);
+            if (copy == NULL) {
+                return -1;
+            }
+            memcpy(copy, key, length);
+            entry->hash = hash;
+            entry->key = copy;
+            entry->length = length;
+            entry->count = amount;
+            table->used++;
+            return 0;
+        }
+        if (entry->hash == hash && entry->length == length && memcmp(entry->key, key, length) == 0) {
+            entry->count += amount;
+            return 0;
+        }
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+}
+
+static void count_table_free(struct count_table *table) {
+    free(table->entries);
+    arena_free(&table->keys);
+    free(table);
+}
+
+// State of one count run. Tasks borrow a table from the free list, so each thread that
+// counts at the same time works on a table of its own and no entry is ever shared.
+struct count_state {
+    char separator;
+    int field;                          // 0 counts whole lines
+    pthread_mutex_t lock;               // Protects free_tables and all_tables
+    struct count_table *free_tables;
+    struct count_table **all_tables;
+    int table_count;
+    atomic_int failed;
+};
+
+static struct count_table *count_borrow_table(struct count_state *state) {
+    pthread_mutex_lock(&state->lock);
+    struct count_table *table = state->free_tables;
+    if (table != NULL) {
+        state->free_tables = table->next_free;
+    } else if ((table = calloc(1, sizeof(*table))) != NULL) {
+        struct count_table **all = realloc(state->all_tables, (state->table_count + 1) * sizeof(*all));
+        if (all == NULL) {
+            free(table);
+            table = NULL;
+        } else {
+            state->all_tables = all;
+            all[state->table_count++] = table;
+        }
+    }
+    pthread_mutex_unlock(&state->lock);
+    return table;
+}
+
+static void count_return_table(struct count_state *state, struct count_table *table) {
+    pthread_mutex_lock(&state->lock);
+    table->next_free = state->free_tables;
+    state->free_tables = table;
+    pthread_mutex_unlock(&state->lock);
+}
+
+// A block of complete lines counted by one pool task
+struct count_chunk {
+    struct count_state *state;
+    const char *start;
+    const char *end;
+    char *owned;        // Block read from a pipe, freed by the task
+};
+
+static void count_chunk_task(void *arg) {
+    struct count_chunk *chunk = arg;
+    struct count_state *state = chunk->state;
+    struct count_table *table = count_borrow_table(state);
+    const char *line = chunk->start;
+    while (table != NULL && line < chunk->end) {
+        const char *newline = memchr(line, '\n', chunk->end - line);
+        const char *line_end = newline != NULL ? newline : chunk->end;
+        const char *key = line;
+        size_t length = line_end - line;
+        if (state->field > 0) {
+            key = line_field(line, length, state->separator, state->field, &length);
+        }
+        if (key != NULL && count_table_add(table, key, length, hash_bytes(key, length), 1) < 0) {
+            atomic_store(&state->failed, 1);
+            break;
+        }
+        line = line_end + 1;
+    }
+    if (table != NULL) {
+        count_return_table(state, table);
+    } else {
+        atomic_store(&state->failed, 1);
+    }
+    free(chunk->owned);
+    free(chunk);
+}
+
+static void count_submit(struct count_state *state, struct task_group *group, const char *start, const char *end,
+                         char *owned) {
+    struct count_chunk *chunk = malloc(sizeof(*chunk));
+    if (chunk == NULL) {
+        atomic_store(&state->failed, 1);
+        free(owned);
+        return;
+    }
+    chunk->state = state;
+    chunk->start = start;
+    chunk->end = end;
+    chunk->owned = owned;
+    thread_pool_submit(group, count_chunk_task, chunk);
+}
+
+// Function for cutting a mapped file into line-aligned blocks for the pool
+static void count_mapped(struct count_state *state, struct task_group *group, const char *data, size_t size) {
+    const char *start = data, *end_of_file = data + size;
+    while (start < end_of_file) {
+        const char *end = start + COUNT_CHUNK_SIZE < end_of_file ? start + COUNT_CHUNK_SIZE : end_of_file;
+        const char *newline = end < end_of_file ? memchr(end, '\n', end_of_file - end) : NULL;
+        end = newline != NULL ? newline + 1 : end_of_file;
+        count_submit(state, group, start, end, NULL);
+        start = end;
+    }
+}
+
+// Function for reading a pipe in large blocks; every block of complete lines becomes a task.
+// Only a bounded number of blocks is in flight, so a fast producer cannot fill the memory.
+// A block without any newline grows until the line ends, so no line is split into two keys.
+static int count_stream(struct count_state *state, struct task_group *group, struct stream *in) {
+    char *block = NULL;
+    size_t length = 0, capacity = COUNT_CHUNK_SIZE;
+    int in_flight = 0;
+    pthread_once(&pool_once, pool_start);
+    for (;;) {
+        if (block == NULL && (block = malloc(capacity)) == NULL) {
+            return -1;
+        }
+        ssize_t count = stream_read(in, block + length, capacity - length);
+        if (count < 0) {
+            free(block);
+            return -1;
+        }
+        length += count;
+        if (count > 0 && length < capacity) {
+            continue;   // Keep filling the block
+        }
+        if (count == 0) {
+            if (length > 0) {
+                count_submit(state, group, block, block + length, block);
+            } else {
+                free(block);
+            }
+            return 0;
+        }
+        const char *newline = memrchr(block, '\n', length);
+        if (newline == NULL) {
+            char *larger = realloc(block, capacity * 2);
+            if (larger == NULL) {
+                free(block);
+                return -1;
+            }
+            block = larger;
+            capacity *= 2;
+            continue;
+        }
+        size_t complete = (size_t)(newline + 1 - block);
+        size_t rest = length - complete;
+        capacity = rest < COUNT_CHUNK_SIZE ? COUNT_CHUNK_SIZE : 2 * rest;
+        char *next = malloc(capacity);
+        if (next == NULL) {
+            free(block);
+            return -1;
+        }
+        memcpy(next, block + complete, rest);
+        count_submit(state, group, block, block + complete, block);
+        block = next;
+        length = rest;
+        if (++in_flight == 2 * pool.size) {
+            task_group_wait(group);
+            in_flight = 0;
+        }
+    }
+}
+
+// Most frequent first, equal counts by key so that the output is stable
+static int count_entry_order(const void *a, const void *b) {
+    const struct count_entry *left = *(struct count_entry *const *)a, *right = *(struct count_entry *const *)b;
+    if (left->count != right->count) {
+        return left->count > right->count ? -1 : 1;
+    }
+    return sort_compare_bytes(left->key, left->length, right->key, right->length);
+}
+
+// Function for the count builtin: count [-f field] [-t sep] [-n top] [file...]
+// Prints how often each line (or field) occurs, most frequent first, like sort | uniq -c | sort -rn.
+int builtin_count(char **args, struct stream *in, struct stream *out) {
+    struct count_state state;
+    memset(&state, 0, sizeof(state));
+    pthread_mutex_init(&state.lock, NULL);
+    size_t top = 0;
+    int a = 1;
+    for (; args[a] != NULL && args[a][0] == '-' && args[a][1] != '\0'; a++) {
+        char flag = args[a][1];
+        const char *value = args[a][2] != '\0' ? args[a] + 2 : args[++a];
+        if ((flag != 'f' && flag != 't' && flag != 'n') || value == NULL) {
+            fprintf(stderr, "Usage: count [-f field] [-t sep] [-n top] [file...]\n");
+            return 1;
+        }
+        if (flag == 'f') {
+            state.field = atoi(value);
+        } else if (flag == 't') {
+            state.separator = value[0];
+        } else {
+            top = strtoul(value, NULL, 10);
+        }
+    }
+
+    struct task_group group = TASK_GROUP_INITIALIZER;
+    struct mapped_file files[MAX_ARGS];
+    int mapped = 0, failed = 0;
+    if (args[a] == NULL && count_stream(&state, &group, in) < 0) {
+        perror("count");
+        failed = 1;
+    }
+    for (; args[a] != NULL; a++) {
+        int fd = open(args[a], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "count: %s: %s\n", args[a], strerror(errno));
+            failed = 1;
+            continue;
+        }
+        if (map_input_file(fd, &files[mapped]) == 0) {
+            count_mapped(&state, &group, files[mapped].data, files[mapped].size);
+            mapped++;
+        } else {
+            struct stream file_stream;
+            stream_init(&file_stream, fd);
+            if (count_stream(&state, &group, &file_stream) < 0) {
+                fprintf(stderr, "count: %s: %s\n", args[a], strerror(errno));
+                failed = 1;
+            }
+        }
+        close(fd);
+    }
+    task_group_wait(&group);
+
+    // Merging the per-thread tables into the first one
+    struct count_table *merged = state.table_count > 0 ? state.all_tables[0] : NULL;
+    for (int t = 1; t < state.table_count && !atomic_load(&state.failed); t++) {
+        struct count_table *table = state.all_tables[t];
+        for (size_t i = 0; i < table->capacity; i++) {
+            struct count_entry *entry = &table->entries[i];
+            if (entry->key != NULL &&
+                count_table_add(merged, entry->key, entry->length, entry->hash, entry->count) < 0) {
+                atomic_store(&state.failed, 1);
+                break;
+            }
+        }
+    }
+    if (atomic_load(&state.failed)) {
+        fprintf(stderr, "count: out of memory\n");
+        failed = 1;
+    } else if (merged != NULL) {
+        struct count_entry **order = malloc(merged->used * sizeof(*order) + 1);
+        size_t used = 0;
+        for (size_t i = 0; order != NULL && i < merged->capacity; i++) {
+            if (merged->entries[i].key != NULL) {
+                order[used++] = &merged->entries[i];
+            }
+        }
+        if (order != NULL) {
+            qsort(order, used, sizeof(*order), count_entry_order);
+        }
+        if (top == 0 || top > used) {
+            top = used;
+        }
+        for (size_t i = 0; i < top; i++) {
+            if (stream_printf(out, "%7zu %.*s\n", order[i]->count, (int)order[i]->length, order[i]->key) < 0) {
+                break;
+            }
+        }
+        free(order);
+    }
+    for (int t = 0; t < state.table_count; t++) {
+        count_table_free(state.all_tables[t]);
+    }
+    free(state.all_tables);
+    for (int m = 0; m < mapped; m++) {
+        unmap_input_file(&files[m]);
+    }
+    pthread_mutex_destroy(&state.lock);
+    return failed;
+}
+
+// Filters and state of one walk run
+struct walk_state {
+    const char *name_glob;      // -name: glob the entry name must match
+    char type;                  // -type: 'f', 'd' or 'l', 0 for any
+    int size_compare;           // -size: -1 smaller than, 0 exactly, 1 larger than size
+    long long size;             // -1 when there is no size filter
+    char terminator;            // '\n', or '\0' with -print0
+    struct stream *out;
+    struct byte_buffer pending; // Output handed over by tasks, guarded by group.lock
+    struct task_group group;
+    atomic_int failed;
+};
+
+// An open directory shared by the tasks of its subdirectories, which open them relative to it
+struct walk_handle {
+    int fd;
+    atomic_int references;
+};
+
+// A directory waiting to be read by a pool task
+struct walk_directory {
+    struct walk_state *state;
+    struct walk_handle *parent; // The directory itself when name is NULL (a starting point)
+    const char *name;           // Points into path
+    char path[];
+};
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static char walk_type_of(unsigned char dirent_type) {
+    return dirent_type == DT_DIR ? 'd' : dirent_type == DT_REG ? 'f' : dirent_type == DT_LNK ? 'l' :
+           dirent_type == DT_UNKNOWN ? 0 : '?';
+}
+
+static char walk_type_of_mode(mode_t mode) {
+    return S_ISDIR(mode) ? 'd' : S_ISREG(mode) ? 'f' : S_ISLNK(mode) ? 'l' : '?';
+}
+
+// Function for deciding whether an entry passes the filters; size is -1 if it was not needed
+static int walk_matches(const struct walk_state *state, const char *name, char type, long long size) {
+    if (state->type && state->type != type) {
+        return 0;
+    }
+    if (state->size >= 0) {
+        if (state->size_compare < 0 ? size >= state->size : state->size_compare > 0 ? size <= state->size
+                                                                                     : size != state->size) {
+            return 0;
+        }
+    }
+    return state->name_glob == NULL || fnmatch(state->name_glob, name, 0) == 0;
+}
+
+static void walk_emit(struct byte_buffer *output, const struct walk_state *state, const char *path, size_t path_length,
+                      const char *name) {
+    buffer_append(output, path, path_length);
+    if (path_length > 0 && path[path_length - 1] != '/') {
+        buffer_append(output, "/", 1);
+    }
+    buffer_append(output, name, strlen(name));
+    buffer_append(output, &state->terminator, 1);
+}
+
+// Function for handing a task's output to the stage thread; tasks never write to the stream
+// themselves, so a slow reader cannot tie up pool workers.
+static void walk_flush(struct walk_state *state, struct byte_buffer *output) {
+    if (output->length > 0) {
+        pthread_mutex_lock(&state->group.lock);
+        if (buffer_append(&state->pending, output->data, output->length) != 0) {
+            atomic_store(&state->failed, 1);
+        }
+        pthread_cond_broadcast(&state->group.done);
+        pthread_mutex_unlock(&state->group.lock);
+        output->length = 0;
+    }
+}
+
+// Function for the stage thread: writing the tasks' output until every task has finished,
+// running queued tasks itself while there is nothing to write
+static void walk_drain(struct walk_state *state) {
+    struct byte_buffer block = {0};
+    for (;;) {
+        int finished = atomic_load(&state->group.pending) == 0;
+        pthread_mutex_lock(&state->group.lock);
+        struct byte_buffer swap = state->pending;
+        state->pending = block;
+        block = swap;
+        pthread_mutex_unlock(&state->group.lock);
+        if (block.length > 0) {
+            stream_write(state->out, block.data, block.length);
+            block.length = 0;
+            continue;
+        }
+        if (finished) {
+            break;
+        }
+        struct task task;
+        if (pool_find_task(pool_worker_index, 0, &task)) {
+            pool_run_task(&task);
+            continue;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 1000000;    // Re-checking every millisecond for work to help with
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&state->group.lock);
+        if (atomic_load(&state->group.pending) > 0 && state->pending.length == 0) {
+            pthread_cond_timedwait(&state->group.done, &state->group.lock, &deadline);
+        }
+        pthread_mutex_unlock(&state->group.lock);
+    }
+    free(block.data);
+    free(state->pending.data);
+}
+
+static void walk_handle_release(struct walk_handle *handle) {
+    if (atomic_fetch_sub(&handle->references, 1) == 1) {
+        close(handle->fd);
+        free(handle);
+    }
+}
+
+static void walk_directory_task(void *arg);
+
+// Function for queueing a directory; takes over one reference to parent
+static void walk_submit(struct walk_state *state, struct walk_handle *parent, const char *path, size_t path_length,
+                        const char *name) {
+    size_t name_length = name != NULL ? strlen(name) : 0;
+    struct walk_directory *directory = malloc(sizeof(*directory) + path_length + name_length + 2);
+    if (directory == NULL) {
+        atomic_store(&state->failed, 1);
+        walk_handle_release(parent);
+        return;
+    }
+    directory->state = state;
+    directory->parent = parent;
+    directory->name = NULL;
+    memcpy(directory->path, path, path_length);
+    size_t length = path_length;
+    if (name != NULL) {
+        if (length > 0 && directory->path[length - 1] != '/') {
+            directory->path[length++] = '/';
+        }
+        directory->name = directory->path + length;
+        memcpy(directory->path + length, name, name_length);
+        length += name_length;
+    }
+    directory->path[length] = '\0';
+    thread_pool_submit(&state->group, walk_directory_task, directory);
+}
+
+// Function for reading one directory with getdents64. Subdirectories become new tasks on this
+// worker's deque, where idle workers steal them; metadata is only fetched with statx when the
+// filters need it or the file system does not report the entry type.
+static void walk_directory_task(void *arg) {
+    struct walk_directory *directory = arg;
+    struct walk_state *state = directory->state;
+    size_t path_length = strlen(directory->path);
+    struct byte_buffer output = {0};
+    char *entries = malloc(WALK_DIRENT_BUFFER);
+    // Opening relative to the parent, so a cd in the shell cannot redirect a running walk
+    struct walk_handle *self = directory->parent;
+    int fd = self->fd;
+    if (directory->name != NULL) {
+        fd = openat(self->fd, directory->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        walk_handle_release(self);
+        self = fd >= 0 ? malloc(sizeof(*self)) : NULL;
+        if (self == NULL && fd >= 0) {
+            close(fd);
+            fd = -1;
+            errno = ENOMEM;
+        } else if (self != NULL) {
+            self->fd = fd;
+            atomic_init(&self->references, 1);
+        }
+    }
+    if (fd < 0 || entries == NULL) {
+        fprintf(stderr, "walk: %s: %s\n", directory->path, strerror(fd < 0 ? errno : ENOMEM));
+        atomic_store(&state->failed, 1);
+    }
+    long count;
+    while (fd >= 0 && entries != NULL && (count = syscall(SYS_getdents64, fd, entries, WALK_DIRENT_BUFFER)) > 0) {
+        for (long offset = 0; offset < count;) {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *)(entries + offset);
+            offset += entry->d_reclen;
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            char type = walk_type_of(entry->d_type);
+            long long size = -1;
+            if (type == 0 || state->size >= 0) {
+                struct statx stx;
+                if (statx(fd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, STATX_TYPE | STATX_SIZE, &stx) == 0) {
+                    type = walk_type_of_mode(stx.stx_mode);
+                    size = stx.stx_size;
+                }
+            }
+            if (walk_matches(state, name, type, size)) {
+                walk_emit(&output, state, directory->path, path_length, name);
+                if (output.length >= STREAM_BUFFER_SIZE) {
+                    walk_flush(state, &output);
+                }
+            }
+            if (type == 'd') {
+                atomic_fetch_add(&self->references, 1);
+                walk_submit(state, self, directory->path, path_length, name);
+            }
+        }
+    }
+    if (self != NULL) {
+        walk_handle_release(self);
+    }
+    walk_flush(state, &output);
+    free(output.data);
+    free(entries);
+    free(directory);
+}
+
+// Function for the walk builtin: walk [path...] [-name glob] [-type f|d|l] [-size [+-]N[kMG]] [-print0]
+// A find-like traversal that reads directories in parallel; the output order is not defined.
+int builtin_walk(char **args, struct stream *in, struct stream *out) {
+    (void)in;
+    struct walk_state state;
+    memset(&state, 0, sizeof(state));
+    state.size = -1;
+    state.terminator = '\n';
+    state.out = out;
+    pthread_mutex_init(&state.group.lock, NULL);
+    pthread_cond_init(&state.group.done, NULL);
+
+    int first_path = 1, path_count = 0, a;
+    for (a = 1; args[a] != NULL && args[a][0] != '-'; a++) {
+        path_count++;
+    }
+    for (; args[a] != NULL; a++) {
+        const char *value = args[a + 1];
+        if (strcmp(args[a], "-print0") == 0) {
+            state.terminator = '\0';
+            continue;
+        }
+        if (value == NULL) {
+            fprintf(stderr, "walk: missing argument to '%s'\n", args[a]);
+            return 1;
+        }
+        if (strcmp(args[a], "-name") == 0) {
+            state.name_glob = value;
+        } else if (strcmp(args[a], "-type") == 0 && strchr("fdl", value[0]) != NULL && value[1] == '\0') {
+            state.type = value[0];
+        } else if (strcmp(args[a], "-size") == 0) {
+            state.size_compare = value[0] == '+' ? 1 : value[0] == '-' ? -1 : 0;
+            char *end;
+            state.size = strtoll(value + (state.size_compare != 0), &end, 10);
+            state.size *= *end == 'k' ? 1024LL : *end == 'M' ? 1024LL * 1024 : *end == 'G' ? 1024LL * 1024 * 1024 : 1;
+        } else {
+            fprintf(stderr, "walk: unknown predicate '%s'\n", args[a]);
+            return 1;
+        }
+        a++;
+    }
+
+    char *default_path[] = {".", NULL};
+    char **paths = path_count > 0 ? args + first_path : default_path;
+    if (path_count == 0) {
+        path_count = 1;
+    }
+    struct byte_buffer output = {0};
+    for (int p = 0; p < path_count; p++) {
+        // The starting points themselves are reported too, like find does.
+        struct statx stx;
+        if (statx(AT_FDCWD, paths[p], AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_SIZE, &stx) != 0) {
+            fprintf(stderr, "walk: %s: %s\n", paths[p], strerror(errno));
+            atomic_store(&state.failed, 1);
+            continue;
+        }
+        const char *slash = strrchr(paths[p], '/');
+        const char *name = slash != NULL && slash[1] != '\0' ? slash + 1 : paths[p];
+        if (walk_matches(&state, name, walk_type_of_mode(stx.stx_mode), stx.stx_size)) {
+            buffer_append(&output, paths[p], strlen(paths[p]));
+            buffer_append(&output, &state.terminator, 1);
+            walk_flush(&state, &output);
+        }
+        if (S_ISDIR(stx.stx_mode)) {
+            struct walk_handle *root = malloc(sizeof(*root));
+            int fd = root != NULL ? openat(AT_FDCWD, paths[p], O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) : -1;
+            if (fd < 0) {
+                fprintf(stderr, "walk: %s: %s\n", paths[p], strerror(root != NULL ? errno : ENOMEM));
+                atomic_store(&state.failed, 1);
+                free(root);
+                continue;
+            }
+            root->fd = fd;
+            atomic_init(&root->references, 1);
+            walk_submit(&state, root, paths[p], strlen(paths[p]), NULL);
+        }
+    }
+    walk_drain(&state);
+    free(output.data);
+    return atomic_load(&state.failed);
+}
+
+// XXH64, the 64-bit xxHash: four independent accumulator lanes over 32-byte stripes,
+// which keeps several multiplies in flight per cycle.
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+struct xxh64_state {
+    uint64_t lanes[4];
+    uint64_t total;
+    unsigned char buffer[32];
+    size_t buffered;
+};
+
+static uint64_t rotate_left64(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static uint64_t read64(const unsigned char *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint64_t xxh64_round(uint64_t accumulator, uint64_t input) {
+    return rotate_left64(accumulator + input * XXH_PRIME2, 31) * XXH_PRIME1;
+}
+
+static void xxh64_init(struct xxh64_state *state) {
+    state->lanes[0] = XXH_PRIME1 + XXH_PRIME2;
+    state->lanes[1] = XXH_PRIME2;
+    state->lanes[2] = 0;
+    state->lanes[3] = -XXH_PRIME1;
+    state->total = 0;
+    state->buffered = 0;
+}
+
+static void xxh64_stripes(uint64_t *lanes, const unsigned char *data, size_t stripes) {
+    uint64_t v1 = lanes[0], v2 = lanes[1], v3 = lanes[2], v4 = lanes[3];
+    for (size_t s = 0; s < stripes; s++, data += 32) {
+        v1 = xxh64_round(v1, read64(data));
+        v2 = xxh64_round(v2, read64(data + 8));
+        v3 = xxh64_round(v3, read64(data + 16));
+        v4 = xxh64_round(v4, read64(data + 24));
+    }
+    lanes[0] = v1;
+    lanes[1] = v2;
+    lanes[2] = v3;
+    lanes[3] = v4;
+}
+
+static void xxh64_update(struct xxh64_state *state, const unsigned char *data, size_t size) {
+    state->total += size;
+    if (state->buffered > 0) {
+        size_t take = 32 - state->buffered < size ? 32 - state->buffered : size;
+        memcpy(state->buffer + state->buffered, data, take);
+        state->buffered += take;
+        data += take;
+        size -= take;
+        if (state->buffered < 32) {
+            return;
+        }
+        xxh64_stripes(state->lanes, state->buffer, 1);
+        state->buffered = 0;
+    }
+    xxh64_stripes(state->lanes, data, size / 32);
+    memcpy(state->buffer, data + size / 32 * 32, size % 32);
+    state->buffered = size % 32;
+}
+
+static uint64_t xxh64_digest(const struct xxh64_state *state) {
+    uint64_t hash;
+    if (state->total >= 32) {
+        const uint64_t *v = state->lanes;
+        hash = rotate_left64(v[0], 1) + rotate_left64(v[1], 7) + rotate_left64(v[2], 12) + rotate_left64(v[3], 18);
+        for (int l = 0; l < 4; l++) {
+            hash = (hash ^ xxh64_round(0, v[l])) * XXH_PRIME1 + XXH_PRIME4;
+        }
+    } else {
+        hash = XXH_PRIME5;
+    }
+    hash += state->total;
+    const unsigned char *p = state->buffer, *end = state->buffer + state->buffered;
+    for (; p + 8 <= end; p += 8) {
+        hash = rotate_left64(hash ^ xxh64_round(0, read64(p)), 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (p + 4 <= end) {
+        hash = rotate_left64(hash ^ (read32(p) * XXH_PRIME1), 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        hash = rotate_left64(hash ^ (*p * XXH_PRIME5), 11) * XXH_PRIME1;
+    }
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME3;
+    return hash ^ (hash >> 32);
+}
+
+// SHA-256 with a portable block function and one that uses the SHA extensions (SHA-NI)
+static const uint32_t sha256_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+struct sha256_state {
+    uint32_t h[8];
+    uint64_t total;
+    unsigned char buffer[64];
+    size_t buffered;
+};
+
+static uint32_t rotate_right32(uint32_t value, int bits) {
+    return (value >> bits) | (value << (32 - bits));
+}
+
+static void sha256_blocks_portable(uint32_t *h, const unsigned char *data, size_t blocks) {
+    for (; blocks > 0; blocks--, data += 64) {
+        uint32_t w[64];
+        for (int t = 0; t < 16; t++) {
+            w[t] = (uint32_t)data[4 * t] << 24 | (uint32_t)data[4 * t + 1] << 16 | (uint32_t)data[4 * t + 2] << 8 | data[4 * t + 3];
+        }
+        for (int t = 16; t < 64; t++) {
+            uint32_t s0 = rotate_right32(w[t - 15], 7) ^ rotate_right32(w[t - 15], 18) ^ (w[t - 15] >> 3);
+            uint32_t s1 = rotate_right32(w[t - 2], 17) ^ rotate_right32(w[t - 2], 19) ^ (w[t - 2] >> 10);
+            w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+        for (int t = 0; t < 64; t++) {
+            uint32_t t1 = k + (rotate_right32(e, 6) ^ rotate_right32(e, 11) ^ rotate_right32(e, 25)) +
+                          ((e & f) ^ (~e & g)) + sha256_constants[t] + w[t];
+            uint32_t t2 = (rotate_right32(a, 2) ^ rotate_right32(a, 13) ^ rotate_right32(a, 22)) +
+                          ((a & b) ^ (a & c) ^ (b & c));
+            k = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+        h[5] += f;
+        h[6] += g;
+        h[7] += k;
+    }
+}
+
+#ifdef __SSE2__
+// Function for hashing blocks with the SHA extensions. The state is kept as the ABEF/CDGH
+// register pair the instructions expect; every iteration runs four rounds with two
+// sha256rnds2 and extends the message schedule with sha256msg1/sha256msg2.
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_blocks_shani(uint32_t *h, const unsigned char *data, size_t blocks) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[0]), 0xb1);     // CDAB
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[4]), 0x1b);  // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);                                   // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);                                        // CDGH
+
+    for (; blocks > 0; blocks--, data += 64) {
+        __m128i abef = state0, cdgh = state1;
+        __m128i message[4];
+        for (int m = 0; m < 4; m++) {
+            message[m] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * m)), byte_swap);
+        }
+        for (int i = 0; i < 16; i++) {
+            __m128i current = message[i & 3];
+            __m128i words = _mm_add_epi32(current, _mm_loadu_si128((const __m128i *)&sha256_constants[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, words);
+            if (i >= 3 && i < 15) {
+                __m128i next = _mm_add_epi32(message[(i + 1) & 3], _mm_alignr_epi8(current, message[(i - 1) & 3], 4));
+                message[(i + 1) & 3] = _mm_sha256msg2_epu32(next, current);
+            }
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(words, 0x0e));
+            if (i >= 1 && i < 13) {
+                message[(i - 1) & 3] = _mm_sha256msg1_epu32(message[(i - 1) & 3], current);
+            }
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);                  // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xb1);               // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);            // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);               // ABEF
+    _mm_storeu_si128((__m128i *)&h[0], state0);
+    _mm_storeu_si128((__m128i *)&h[4], state1);
+}
+#endif
+
+static void (*sha256_blocks)(uint32_t *h, const unsigned char *data, size_t blocks) = sha256_blocks_portable;
+
+// Function for picking the SHA-NI block function when the CPU has the SHA extensions
+static void sha256_select(void) {
+#ifdef __SSE2__
+    unsigned eax, ebx, ecx, edx;
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1u << 29)) &&
+        __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_1) && (ecx & bit_SSSE3)) {
+        sha256_blocks = sha256_blocks_shani;
+    }
+#endif
+}
+
+static void sha256_init(struct sha256_state *state) {
+    static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(state->h, initial, sizeof(initial));
+    state->total = 0;
+    state->buffered = 0;
+}
+
+static void sha256_update(struct sha256_state *state, const unsigned char *data, size_t size) {
+    state->total += size;
+    if (state->buffered > 0) {
+        size_t take = 64 - state->buffered < size ? 64 - state->buffered : size;
+        memcpy(state->buffer + state->buffered, data, take);
+        state->buffered += take;
+        data += take;
+        size -= take;
+        if (state->buffered < 64) {
+            return;
+        }
+        sha256_blocks(state->h, state->buffer, 1);
+        state->buffered = 0;
+    }
+    sha256_blocks(state->h, data, size / 64);
+    memcpy(state->buffer, data + size / 64 * 64, size % 64);
+    state->buffered = size % 64;
+}
+
+static void sha256_final(struct sha256_state *state, unsigned char digest[32]) {
+    uint64_t bits = state->total * 8;
+    unsigned char padding[72] = {0x80};
+    size_t pad = (state->buffered < 56 ? 56 : 120) - state->buffered;
+    for (int i = 0; i < 8; i++) {
+        padding[pad + i] = bits >> (56 - 8 * i);
+    }
+    sha256_update(state, padding, pad + 8);
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = state->h[i] >> 24;
+        digest[4 * i + 1] = state->h[i] >> 16;
+        digest[4 * i + 2] = state->h[i] >> 8;
+        digest[4 * i + 3] = state->h[i];
+    }
+}
+
+// One input of hashsum: hashed by a pool task, printed afterwards in argument order
+struct hashsum_job {
+    const char *path;
+    int fast;               // xxh64 instead of SHA-256
+    struct stream *in;      // Set for standard input
+    char hex[65];
+    int error;              // errno of a failure, 0 on success
+};
+
+static void hashsum_job_task(void *arg) {
+    struct hashsum_job *job = arg;
+    struct xxh64_state xxh;
+    struct sha256_state sha;
+    xxh64_init(&xxh);
+    sha256_init(&sha);
+    struct mapped_file file = {NULL, 0};
+    int fd = job->in != NULL ? -1 : open(job->path, O_RDONLY | O_CLOEXEC);
+    if (job->in == NULL && fd < 0) {
+        job->error = errno;
+        return;
+    }
+    if (fd >= 0 && map_input_file(fd, &file) == 0) {
+        if (job->fast) {
+            xxh64_update(&xxh, (const unsigned char *)file.data, file.size);
+        } else {
+            sha256_update(&sha, (const unsigned char *)file.data, file.size);
+        }
+        unmap_input_file(&file);
+    } else {
+        // Pipes and devices are read in large blocks.
+        struct stream file_stream;
+        struct stream *in = job->in;
+        unsigned char *block = malloc(HASHSUM_READ_SIZE);
+        ssize_t count = -1;
+        if (in == NULL) {
+            stream_init(&file_stream, fd);
+            in = &file_stream;
+        }
+        while (block != NULL && (count = stream_read(in, block, HASHSUM_READ_SIZE)) > 0) {
+            if (job->fast) {
+                xxh64_update(&xxh, block, count);
+            } else {
+                sha256_update(&sha, block, count);
+            }
+        }
+        if (count < 0) {
+            job->error = block == NULL ? ENOMEM : errno;
+        }
+        free(block);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (job->fast) {
+        snprintf(job->hex, sizeof(job->hex), "%016llx", (unsigned long long)xxh64_digest(&xxh));
+    } else {
+        unsigned char digest[32];
+        sha256_final(&sha, digest);
+        for (int i = 0; i < 32; i++) {
+            snprintf(job->hex + 2 * i, 3, "%02x", digest[i]);
+        }
+    }
+}
+
+// Function for the hashsum builtin: hashsum [-x] [file...]
+// Prints SHA-256 sums (or XXH64 with -x) in the "hash  name" format of sha256sum, hashing
+// the files in parallel across the pool.
+int builtin_hashsum(char **args, struct stream *in, struct stream *out) {
+    static pthread_once_t select_once = PTHREAD_ONCE_INIT;
+    pthread_once(&select_once, sha256_select);
+    int fast = 0, a = 1;
+    for (; args[a] != NULL && args[a][0] == '-' && args[a][1] != '\0'; a++) {
+        if (strcmp(args[a], "-x") == 0) {
+            fast = 1;
+        } else {
+            fprintf(stderr, "Usage: hashsum [-x] [file...]\n");
+            return 1;
+        }
+    }
+    struct hashsum_job jobs[MAX_ARGS];
+    int job_count = 0;
+    struct task_group group = TASK_GROUP_INITIALIZER;
+    if (args[a] == NULL) {
+        jobs[0] = (struct hashsum_job){"-", fast, in, "", 0};
+        hashsum_job_task(&jobs[0]);
+        job_count = 1;
+    }
+    for (; args[a] != NULL; a++, job_count++) {
+        jobs[job_count] = (struct hashsum_job){args[a], fast, NULL, "", 0};
+        thread_pool_submit(&group, hashsum_job_task, &jobs[job_count]);
+    }
+    task_group_wait(&group);
+    int failed = 0;
+    for (int j = 0; j < job_count; j++) {
+        if (jobs[j].error != 0) {
+            fprintf(stderr, "hashsum: %s: %s\n", jobs[j].path, strerror(jobs[j].error));
+            failed = 1;
+        } else {
+            stream_printf(out, "%s  %s\n", jobs[j].hex, jobs[j].path);
+        }
+    }
+    return failed;
+}
+
+// Function for copying the contents of one open file to another without passing the data
+// through user space when the kernel can avoid it: first a reflink (FICLONE) that shares the
+// extents, then copy_file_range, then sendfile, and read/write only as the last resort.
+int copy_file_data(int from, int to, off_t size) {
+    if (ioctl(to, FICLONE, from) == 0) {
+        return 0;
+    }
+    off_t copied = 0;
+    while (copied < size) {
+        ssize_t count = copy_file_range(from, NULL, to, NULL, size - copied, 0);
+        if (count <= 0) {
+            break;      // Not supported here (EXDEV, ENOSYS, EINVAL...) or a file that lied about its size
+        }
+        copied += count;
+    }
+    while (copied < size) {
+        ssize_t count = sendfile(to, from, NULL, size - copied);
+        if (count <= 0) {
+            break;
+        }
+        copied += count;
+    }
+    if (copied >= size && size > 0) {
+        return 0;
+    }
+    // Files that report no size (/proc and friends) or file systems without the calls above
+    if (lseek(from, copied, SEEK_SET) < 0 || lseek(to, copied, SEEK_SET) < 0) {
+        return -1;
+    }
+    char *block = malloc(COPY_BLOCK_SIZE);
+    ssize_t count = -1;
+    while (block != NULL && (count = read(from, block, COPY_BLOCK_SIZE)) > 0) {
+        if (write_all(to, block, count) < 0) {
+            count = -1;
+            break;
+        }
+    }
+    free(block);
+    return count < 0 ? -1 : 0;
+}
+
+// State shared by the tasks of one cp (or cross-device mv) run
+struct copy_state {
+    struct task_group group;
+    atomic_int failed;
+    const char *name;       // Builtin the errors are reported for
+};
+
+// One file or directory waiting to be copied by a pool task. A directory job stays alive until
+// its entries are copied (pending counts its own task plus every entry still being copied), so
+// its real mode can be set once nothing more needs to be written into it.
+struct copy_job {
+    struct copy_state *state;
+    struct copy_job *parent;
+    atomic_int pending;
+    int follow;             // stat instead of lstat: operands of cp, and everything without -r
+    int fd;                 // Directory created by this job, -1 when its mode needs no change
+    mode_t mode;            // Mode to give fd at the end
+    char *target;           // Points into source's allocation
+    char source[];
+};
+
+static void copy_report(struct copy_state *state, const char *path) {
+    fprintf(stderr, "%s: %s: %s\n", state->name, path, strerror(errno));
+    atomic_store(&state->failed, 1);
+}
+
+static void copy_release(struct copy_job *job) {
+    while (job != NULL && atomic_fetch_sub(&job->pending, 1) == 1) {
+        if (job->fd >= 0) {
+            if (fchmod(job->fd, job->mode) < 0) {
+                copy_report(job->state, job->target);
+            }
+            close(job->fd);
+        }
+        struct copy_job *parent = job->parent;
+        free(job);
+        job = parent;
+    }
+}
+
+static void copy_tree_task(void *arg);
+
+static void copy_submit(struct copy_state *state, struct copy_job *parent, const char *source, const char *target,
+                        int follow) {
+    size_t source_length = strlen(source) + 1, target_length = strlen(target) + 1;
+    struct copy_job *job = malloc(sizeof(*job) + source_length + target_length);
+    if (job == NULL) {
+        errno = ENOMEM;
+        copy_report(state, source);
+        return;
+    }
+    job->state = state;
+    job->parent = parent;
+    atomic_init(&job->pending, 1);
+    job->follow = follow;
+    job->fd = -1;
+    if (parent != NULL) {
+        atomic_fetch_add(&parent->pending, 1);
+    }
+    memcpy(job->source, source, source_length);
+    job->target = job->source + source_length;
+    memcpy(job->target, target, target_length);
+    thread_pool_submit(&state->group, copy_tree_task, job);
+}
+
+// Function for copying one regular file, keeping its permission bits. A target that is the
+// source itself (the same inode under any name) is refused before O_TRUNC could empty it.
+static void copy_regular_file(struct copy_state *state, const char *source, const char *target) {
+    struct stat st, target_st;
+    int from = open(source, O_RDONLY | O_CLOEXEC);
+    if (from < 0 || fstat(from, &st) < 0) {
+        copy_report(state, source);
+        if (from >= 0) {
+            close(from);
+        }
+        return;
+    }
+    if (stat(target, &target_st) == 0 && target_st.st_dev == st.st_dev && target_st.st_ino == st.st_ino) {
+        fprintf(stderr, "%s: '%s' and '%s' are the same file\n", state->name, source, target);
+        atomic_store(&state->failed, 1);
+        close(from);
+        return;
+    }
+    int to = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 07777);
+    if (to < 0) {
+        copy_report(state, target);
+        close(from);
+        return;
+    }
+    int result = copy_file_data(from, to, st.st_size);
+    close(from);
+    if ((close(to) < 0 && result == 0) || result < 0) {
+        copy_report(state, source);
+    }
+}
+
+// Function for copying one entry of a tree. Directories are created before their entries are
+// handed out as new tasks, so every file task finds its parent already in place.
+static void copy_tree_task(void *arg) {
+    struct copy_job *job = arg;
+    struct copy_state *state = job->state;
+    struct stat st;
+    if ((job->follow ? stat(job->source, &st) : lstat(job->source, &st)) < 0) {
+        copy_report(state, job->source);
+    } else if (S_ISLNK(st.st_mode)) {
+        char link[PATH_MAX];
+        ssize_t length = readlink(job->source, link, sizeof(link) - 1);
+        if (length < 0) {
+            copy_report(state, job->source);
+        } else {
+            link[length] = '\0';
+            if (symlink(link, job->target) < 0) {
+                copy_report(state, job->target);
+            }
+        }
+    } else if (S_ISDIR(st.st_mode)) {
+        DIR *directory = NULL;
+        int created = mkdir(job->target, (st.st_mode & 07777) | S_IRWXU) == 0;
+        if ((!created && errno != EEXIST) || (directory = opendir(job->source)) == NULL) {
+            copy_report(state, job->source);
+        }
+        // The owner needs rwx while the entries are copied in; a new directory gets the source's
+        // mode, less the umask that mkdir applied, when the last entry is done.
+        struct stat made;
+        if (created && (st.st_mode & S_IRWXU) != S_IRWXU &&
+            (job->fd = open(job->target, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) >= 0) {
+            if (fstat(job->fd, &made) == 0) {
+                job->mode = made.st_mode & st.st_mode & 07777;
+            } else {
+                close(job->fd);
+                job->fd = -1;
+            }
+        }
+        struct dirent *entry;
+        while (directory != NULL && (entry = readdir(directory)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            char source[PATH_MAX], target[PATH_MAX];
+            if (snprintf(source, sizeof(source), "%s/%s", job->source, entry->d_name) >= (int)sizeof(source) ||
+                snprintf(target, sizeof(target), "%s/%s", job->target, entry->d_name) >= (int)sizeof(target)) {
+                errno = ENAMETOOLONG;
+                copy_report(state, source);
+                continue;
+            }
+            copy_submit(state, job, source, target, 0);
+        }
+        if (directory != NULL) {
+            closedir(directory);
+        }
+    } else {
+        copy_regular_file(state, job->source, job->target);
+    }
+    copy_release(job);
+}
+
+// Function for building dest/basename(source) when dest is a directory
+static const char *copy_target(const char *source, const char *dest, int dest_is_directory, char *buffer, size_t size) {
+    if (!dest_is_directory) {
+        return dest;
+    }
+    size_t length = strlen(source);
+    while (length > 1 && source[length - 1] == '/') {
+        length--;
+    }
+    const char *base = source + length;
+    while (base > source && base[-1] != '/') {
+        base--;
+    }
+    snprintf(buffer, size, "%s/%.*s", dest, (int)(source + length - base), base);
+    return buffer;
+}
+
+// Function for telling whether target (which need not exist yet) lies inside the directory
+// source, by comparing the resolved source with the resolved parent of target
+static int copy_into_itself(const char *source, const char *target) {
+    char source_path[PATH_MAX], parent_path[PATH_MAX], parent[PATH_MAX];
+    snprintf(parent, sizeof(parent), "%s", target);
+    char *slash = strrchr(parent, '/');
+    while (slash != NULL && slash > parent && slash[1] == '\0') {  // Trailing slashes
+        *slash = '\0';
+        slash = strrchr(parent, '/');
+    }
+    if (slash == NULL) {
+        strcpy(parent, ".");
+    } else {
+        slash[slash == parent] = '\0';     // Keeps "/" for a target in the root
+    }
+    if (realpath(source, source_path) == NULL || realpath(parent, parent_path) == NULL) {
+        return 0;
+    }
+    size_t length = strlen(source_path);
+    return strncmp(parent_path, source_path, length) == 0 &&
+           (parent_path[length] == '\0' || parent_path[length] == '/' || length == 1);
+}
+
+// Function for copying sources into dest, the common part of cp and cross-device mv (name is
+// the builtin the errors are reported for). follow makes symlinks named as sources count as
+// what they point to, as cp does; mv moves the links themselves.
+static int copy_paths(char **sources, int count, const char *dest, int recursive, int follow, const char *name) {
+    struct copy_state state;
+    memset(&state, 0, sizeof(state));
+    pthread_mutex_init(&state.group.lock, NULL);
+    pthread_cond_init(&state.group.done, NULL);
+    state.name = name;
+    struct stat dest_st;
+    int dest_is_directory = stat(dest, &dest_st) == 0 && S_ISDIR(dest_st.st_mode);
+    if (count > 1 && !dest_is_directory) {
+        fprintf(stderr, "%s: target '%s' is not a directory\n", name, dest);
+        return 1;
+    }
+    for (int s = 0; s < count; s++) {
+        char buffer[PATH_MAX];
+        const char *target = copy_target(sources[s], dest, dest_is_directory, buffer, sizeof(buffer));
+        struct stat st;
+        if ((follow ? stat(sources[s], &st) : lstat(sources[s], &st)) < 0) {
+            copy_report(&state, sources[s]);
+        } else if (S_ISDIR(st.st_mode) && !recursive) {
+            fprintf(stderr, "%s: -r not specified; omitting directory '%s'\n", name, sources[s]);
+            atomic_store(&state.failed, 1);
+        } else if (S_ISDIR(st.st_mode) && copy_into_itself(sources[s], target)) {
+            fprintf(stderr, "%s: cannot copy a directory, '%s', into itself, '%s'\n", name, sources[s], target);
+            atomic_store(&state.failed, 1);
+        } else {
+            copy_submit(&state, NULL, sources[s], target, follow);
+        }
+    }
+    task_group_wait(&state.group);
+    return atomic_load(&state.failed);
+}
+
+// Function for the cp builtin: cp [-r] source... dest
+// Files are reflinked or copied inside the kernel, trees are copied by the pool.
+int builtin_cp(char **args) {
+    int recursive = 0, a = 1;
+    for (; args[a] != NULL && args[a][0] == '-'; a++) {
+        if (strcmp(args[a], "-r") == 0 || strcmp(args[a], "-R") == 0) {
+            recursive = 1;
+        } else {
+            fprintf(stderr, "cp: invalid option '%s'\n", args[a]);
+            return 1;
+        }
+    }
+    int count = 0;
+    while (args[a + count] != NULL) {
+        count++;
+    }
+    if (count < 2) {
+        fprintf(stderr, "Usage: cp [-r] source... dest\n");
+        return 1;
+    }
+    return copy_paths(args + a, count - 1, args[a + count - 1], recursive, 1, "cp");
+}
+
+int remove_paths(char **paths, int count, int recursive, int force);
+
+// Function for the mv builtin: mv source... dest
+// A rename is tried first; only a move to another file system copies the data.
+int builtin_mv(char **args) {
+    int count = 0;
+    while (args[1 + count] != NULL) {
+        count++;
+    }
+    if (count < 2) {
+        fprintf(stderr, "Usage: mv source... dest\n");
+        return 1;
+    }
+    const char *dest = args[count];
+    struct stat dest_st;
+    int dest_is_directory = stat(dest, &dest_st) == 0 && S_ISDIR(dest_st.st_mode);
+    if (count > 2 && !dest_is_directory) {
+        fprintf(stderr, "mv: target '%s' is not a directory\n", dest);
+        return 1;
+    }
+    int failed = 0;
+    for (int s = 1; s < count; s++) {
+        char buffer[PATH_MAX];
+        const char *target = copy_target(args[s], dest, dest_is_directory, buffer, sizeof(buffer));
+        if (rename(args[s], target) == 0) {
+            continue;
+        }
+        struct stat st;
+        if (errno != EXDEV || lstat(args[s], &st) < 0) {
+            fprintf(stderr, "mv: %s: %s\n", args[s], strerror(errno));
+            failed = 1;
+        } else if (copy_paths(&args[s], 1, target, S_ISDIR(st.st_mode), 0, "mv") != 0) {
+            fprintf(stderr, "mv: %s: copy failed, source left in place\n", args[s]);
+            failed = 1;
+        } else {
+            failed |= remove_paths(&args[s], 1, 1, 0);
+        }
+    }
+    return failed;
+}
+
+// A directory being emptied. pending counts the task listing it plus one per subdirectory
+// still being removed; whoever drops it to zero removes the directory and releases the parent,
+// so directories go bottom-up without any thread waiting for another. Every directory is opened
+// and removed relative to its parent's fd, never by its path, so a directory swapped for a
+// symlink in the middle of the tree cannot redirect the removal.
+struct remove_node {
+    struct remove_node *parent;
+    atomic_int pending;
+    struct remove_state *state;
+    int parent_fd;          // The parent's fd; a starting point's own, opened by remove_paths
+    int fd;                 // Open until the directory itself is removed
+    const char *name;       // Points into path, which is only used in messages
+    char path[];
+};
+
+struct remove_state {
+    struct task_group group;
+    int force;              // -f: missing files are not an error
+    atomic_int failed;
+};
+
+static void remove_report(struct remove_state *state, const char *path, int error) {
+    if (state->force && error == ENOENT) {
+        return;
+    }
+    fprintf(stderr, "rm: cannot remove '%s': %s\n", path, strerror(error));
+    atomic_store(&state->failed, 1);
+}
+
+static void remove_release(struct remove_node *node) {
+    while (node != NULL && atomic_fetch_sub(&node->pending, 1) == 1) {
+        if (node->fd >= 0) {
+            close(node->fd);
+        }
+        if (unlinkat(node->parent_fd, node->name, AT_REMOVEDIR) < 0) {
+            remove_report(node->state, node->path, errno);
+        }
+        struct remove_node *parent = node->parent;
+        if (parent == NULL) {
+            close(node->parent_fd);
+        }
+        free(node);
+        node = parent;
+    }
+}
+
+static void remove_directory_task(void *arg);
+
+// Function for queueing a directory: name inside parent, or with a NULL parent the starting
+// point path (without trailing slashes) inside parent_fd, which the node then owns
+static void remove_submit(struct remove_state *state, struct remove_node *parent, int parent_fd, const char *path,
+                          size_t path_length, const char *name) {
+    size_t name_length = name != NULL ? strlen(name) + 1 : 0;
+    struct remove_node *node = malloc(sizeof(*node) + path_length + name_length + 1);
+    if (node == NULL) {
+        remove_report(state, path, ENOMEM);
+        if (parent == NULL) {
+            close(parent_fd);
+        }
+        return;
+    }
+    node->parent = parent;
+    node->state = state;
+    node->parent_fd = parent_fd;
+    node->fd = -1;
+    atomic_init(&node->pending, 1);
+    memcpy(node->path, path, path_length);
+    if (name != NULL) {
+        node->path[path_length] = '/';
+        memcpy(node->path + path_length + 1, name, name_length - 1);
+    }
+    node->path[path_length + name_length] = '\0';
+    const char *base = node->path + path_length + name_length;
+    while (base > node->path && base[-1] != '/') {
+        base--;
+    }
+    node->name = *base != '\0' ? base : node->path;    // Only / itself has no last component
+    if (parent != NULL) {
+        atomic_fetch_add(&parent->pending, 1);
+    }
+    thread_pool_submit(&state->group, remove_directory_task, node);
+}
+
+// Function for emptying one directory: files are unlinked relative to the directory's fd,
+// subdirectories become tasks of their own
+static void remove_directory_task(void *arg) {
+    struct remove_node *node = arg;
+    struct remove_state *state = node->state;
+    char *entries = malloc(WALK_DIRENT_BUFFER);
+    int fd = openat(node->parent_fd, node->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    node->fd = fd;
+    if (fd < 0 || entries == NULL) {
+        remove_report(state, node->path, fd < 0 ? errno : ENOMEM);
+    }
+    long count;
+    while (fd >= 0 && entries != NULL && (count = syscall(SYS_getdents64, fd, entries, WALK_DIRENT_BUFFER)) > 0) {
+        for (long offset = 0; offset < count;) {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *)(entries + offset);
+            offset += entry->d_reclen;
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            int directory = entry->d_type == DT_DIR;
+            if (entry->d_type == DT_UNKNOWN) {
+                struct stat st;
+                directory = fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+            }
+            if (directory) {
+                remove_submit(state, node, fd, node->path, strlen(node->path), name);
+            } else if (unlinkat(fd, name, 0) < 0) {
+                char path[PATH_MAX];
+                snprintf(path, sizeof(path), "%s/%s", node->path, name);
+                remove_report(state, path, errno);
+            }
+        }
+    }
+    free(entries);
+    remove_release(node);
+}
+
+// Function for removing paths (trees too when recursive) with the pool, returns 1 on failure
+int remove_paths(char **paths, int count, int recursive, int force) {
+    struct remove_state state;
+    memset(&state, 0, sizeof(state));
+    pthread_mutex_init(&state.group.lock, NULL);
+    pthread_cond_init(&state.group.done, NULL);
+    state.force = force;
+    for (int p = 0; p < count; p++) {
+        struct stat st;
+        if (lstat(paths[p], &st) < 0) {
+            remove_report(&state, paths[p], errno);
+        } else if (!S_ISDIR(st.st_mode)) {
+            if (unlink(paths[p]) < 0) {
+                remove_report(&state, paths[p], errno);
+            }
+        } else if (!recursive) {
+            remove_report(&state, paths[p], EISDIR);
+        } else {
+            // The directory holding the starting point is the only one opened by path.
+            size_t length = strlen(paths[p]);
+            while (length > 1 && paths[p][length - 1] == '/') {
+                length--;
+            }
+            size_t base = length;
+            while (base > 0 && paths[p][base - 1] != '/') {
+                base--;
+            }
+            char directory[PATH_MAX];
+            snprintf(directory, sizeof(directory), "%.*s", (int)base, paths[p]);
+            int parent_fd = open(base > 0 ? directory : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (parent_fd < 0) {
+                remove_report(&state, paths[p], errno);
+            } else {
+                remove_submit(&state, NULL, parent_fd, paths[p], length, NULL);
+            }
+        }
+    }
+    task_group_wait(&state.group);
+    return atomic_load(&state.failed);
+}
+
+// Function for renaming a path next to itself (.rm-<pid>-<n>-<name>) so that it disappears
+// at once and can be deleted afterwards
+static int remove_rename_aside(const char *path, char *aside, size_t size) {
+    static atomic_int counter;
+    size_t length = strlen(path);
+    while (length > 1 && path[length - 1] == '/') {
+        length--;
+    }
+    const char *base = path + length;
+    while (base > path && base[-1] != '/') {
+        base--;
+    }
+    snprintf(aside, size, "%.*s.rm-%d-%d-%.*s", (int)(base - path), path, (int)getpid(),
+             atomic_fetch_add(&counter, 1), (int)(path + length - base), base);
+    return rename(path, aside);
+}
+
+// Function for the guards of coreutils rm: a path whose last component is . or .. is never
+// removed, and neither is / when recursing unless preserve_root is off. Returns 1 if refused.
+static int remove_refused(const char *path, int recursive, int preserve_root) {
+    size_t length = strlen(path);
+    while (length > 1 && path[length - 1] == '/') {
+        length--;
+    }
+    const char *base = path + length;
+    while (base > path && base[-1] != '/') {
+        base--;
+    }
+    size_t base_length = path + length - base;
+    if ((base_length == 1 && base[0] == '.') || (base_length == 2 && base[0] == '.' && base[1] == '.')) {
+        fprintf(stderr, "rm: refusing to remove '.' or '..' directory: skipping '%s'\n", path);
+        return 1;
+    }
+    struct stat st, root;
+    if (recursive && preserve_root && lstat(path, &st) == 0 && stat("/", &root) == 0 && st.st_dev == root.st_dev &&
+        st.st_ino == root.st_ino) {
+        fprintf(stderr, "rm: it is dangerous to operate recursively on '%s'\n", path);
+        fprintf(stderr, "rm: use --no-preserve-root to override this failsafe\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Function for deleting paths renamed aside; what could not be deleted goes back under its own
+// name, unless that name was taken in the meantime
+static int remove_asides(char **asides, char **originals, int count, int recursive, int force) {
+    int failed = 0;
+    for (int p = 0; p < count; p++) {
+        struct stat st;
+        if (remove_paths(&asides[p], 1, recursive, force) != 0) {
+            failed = 1;
+            if (lstat(asides[p], &st) == 0 && renameat2(AT_FDCWD, asides[p], AT_FDCWD, originals[p], RENAME_NOREPLACE) < 0) {
+                fprintf(stderr, "rm: '%s' left as '%s': %s\n", originals[p], asides[p], strerror(errno));
+            }
+        }
+    }
+    return failed;
+}
+
+struct job *add_job(const pid_t *pids, int count, int background, pid_t pgid, const char *command);
+
+// Function for the rm builtin: rm [-r] [-f] [-b] [--no-preserve-root] path...
+// -b renames the paths aside and deletes them in a background job.
+int builtin_rm(char **args) {
+    int recursive = 0, force = 0, background = 0, preserve_root = 1, a = 1;
+    for (; args[a] != NULL && args[a][0] == '-' && args[a][1] != '\0'; a++) {
+        if (strcmp(args[a], "--preserve-root") == 0 || strcmp(args[a], "--no-preserve-root") == 0) {
+            preserve_root = args[a][2] == 'p';
+            continue;
+        } else if (strcmp(args[a], "--") == 0) {
+            a++;
+            break;
+        }
+        for (const char *flag = args[a] + 1; *flag; flag++) {
+            if (*flag == 'r' || *flag == 'R') {
+                recursive = 1;
+            } else if (*flag == 'f') {
+                force = 1;
+            } else if (*flag == 'b') {
+                background = 1;
+            } else {
+                fprintf(stderr, "rm: invalid option -- '%c'\n", *flag);
+                return 1;
+            }
+        }
+    }
+    char *paths[MAX_ARGS];
+    int count = 0, failed = 0;
+    for (; args[a] != NULL; a++) {
+        if (remove_refused(args[a], recursive, preserve_root)) {
+            failed = 1;
+        } else if (count < MAX_ARGS) {
+            paths[count++] = args[a];
+        }
+    }
+    if (count == 0) {
+        if (!force && !failed) {
+            fprintf(stderr, "Usage: rm [-r] [-f] [-b] path...\n");
+        }
+        return force && !failed ? 0 : 1;
+    }
+    if (!background) {
+        return remove_paths(paths, count, recursive, force) | failed;
+    }
+
+    char asides[MAX_ARGS][PATH_MAX];
+    char *aside_paths[MAX_ARGS], *original_paths[MAX_ARGS];
+    int aside_count = 0;
+    for (int p = 0; p < count; p++) {
+        // The checks of the foreground path come first, so nothing is renamed that rm would refuse.
+        struct stat st;
+        int error = lstat(paths[p], &st) < 0 ? errno : S_ISDIR(st.st_mode) && !recursive ? EISDIR : 0;
+        if (error == 0 && remove_rename_aside(paths[p], asides[aside_count], PATH_MAX) < 0) {
+            error = errno;
+        }
+        if (error != 0) {
+            if (!force || error != ENOENT) {
+                fprintf(stderr, "rm: cannot remove '%s': %s\n", paths[p], strerror(error));
+                failed = 1;
+            }
+            continue;
+        }
+        aside_paths[aside_count] = asides[aside_count];
+        original_paths[aside_count] = paths[p];
+        aside_count++;
+    }
+    if (aside_count == 0) {
+        return failed;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return remove_asides(aside_paths, original_paths, aside_count, recursive, force) | failed;
+    } else if (pid == 0) {
+        // _exit: exit would flush stdio buffers shared with the shell, such as the script being read
+        _exit(remove_asides(aside_paths, original_paths, aside_count, recursive, force));
+    }
+    char command[MAX_COMMAND_LENGTH];
+    size_t length = 0;
+    command[0] = '\0';
+    for (int w = 0; args[w] != NULL && length < sizeof(command); w++) {
+        length += snprintf(command + length, sizeof(command) - length, w == 0 ? "%s" : " %s", args[w]);
+    }
+    add_job(&pid, 1, 1, 0, command);
+    printf("Background process with PID: %d\n", pid);
+    return failed;
+}
+
+// Function for finding where the last `lines` lines of a block start. A final line without a
+// newline counts as a line. Whole 16-byte blocks are skipped with a popcount of their newlines.
+static size_t tail_line_start(const char *data, size_t size, size_t lines) {
+    if (lines == 0) {
+        return size;
+    }
+    size_t position = size > 0 && data[size - 1] == '\n' ? size - 1 : size;
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (position >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + position - 16));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+        size_t found = __builtin_popcount(mask);
+        if (found >= lines) {
+            while (--lines > 0) {       // Drop the newlines nearer the end
+                mask &= ~(1u << (31 - __builtin_clz(mask)));
+            }
+            return position - 16 + (31 - __builtin_clz(mask)) + 1;
+        }
+        lines -= found;
+        position -= 16;
+    }
+#endif
+    while (position > 0) {
+        const char *newline_at = memrchr(data, '\n', position);
+        if (newline_at == NULL) {
+            return 0;
+        }
+        if (--lines == 0) {
+            return newline_at - data + 1;
+        }
+        position = newline_at - data;
+    }
+    return 0;
+}
+
+// Function for finding where the first `lines` lines of a block end
+static size_t head_line_end(const char *data, size_t size, size_t *lines) {
+    size_t position = 0;
+    while (*lines > 0 && position < size) {
+        const char *newline_at = memchr(data + position, '\n', size - position);
+        if (newline_at == NULL) {
+            return size;
+        }
+        position = newline_at - data + 1;
+        (*lines)--;
+    }
+    return position;
+}
+
+// Function for parsing the count given to -n or -c
+static int head_tail_parse_count(const char *name, const char *value, size_t *count) {
+    char *end;
+    errno = 0;
+    unsigned long long parsed = value != NULL ? strtoull(value, &end, 10) : 0;
+    if (value == NULL || value[0] == '-' || end == value || *end != '\0' || errno != 0) {
+        fprintf(stderr, "%s: invalid count '%s'\n", name, value != NULL ? value : "");
+        return -1;
+    }
+    *count = parsed;
+    return 0;
+}
+
+struct head_tail_options {
+    size_t count;
+    int bytes;      // -c: count bytes rather than lines
+    int follow;     // -f (tail only)
+};
+
+// Function for parsing head/tail options, returns the index of the first file or -1
+static int head_tail_parse(const char *name, char **args, struct head_tail_options *options) {
+    options->count = 10;
+    int a = 1;
+    for (; args[a] != NULL && args[a][0] == '-' && args[a][1] != '\0'; a++) {
+        for (const char *flag = args[a] + 1; *flag; flag++) {
+            if (*flag == 'f' && strcmp(name, "tail") == 0) {
+                options->follow = 1;
+            } else if (*flag == 'n' || *flag == 'c') {
+                options->bytes = *flag == 'c';
+                const char *value = flag[1] != '\0' ? flag + 1 : args[++a];
+                if (head_tail_parse_count(name, value, &options->count) < 0) {
+                    return -1;
+                }
+                break;
+            } else {
+                fprintf(stderr, "%s: invalid option -- '%c'\n", name, *flag);
+                return -1;
+            }
+        }
+    }
+    return a;
+}
+
+// Function for copying the head of a stream, stops reading as soon as it has enough
+static int head_stream(struct stream *in, struct stream *out, const struct head_tail_options *options) {
+    char *block = malloc(TAIL_READ_SIZE);
+    size_t left = options->count;
+    ssize_t count = 0;
+    while (block != NULL && left > 0 && (count = stream_read(in, block, TAIL_READ_SIZE)) > 0) {
+        size_t length;
+        if (options->bytes) {
+            length = (size_t)count < left ? (size_t)count : left;
+            left -= length;
+        } else {
+            length = head_line_end(block, count, &left);
+        }
+        stream_write(out, block, length);
+    }
+    free(block);
+    return block == NULL || count < 0 ? -1 : 0;
+}
+
+// Function for copying the tail of a stream. Only a window that still holds the wanted tail
+// is kept: whenever it doubles, everything before the tail found so far is dropped.
+static int tail_stream(struct stream *in, struct stream *out, const struct head_tail_options *options) {
+    struct byte_buffer window = {NULL, 0, 0};
+    size_t limit = TAIL_WINDOW_MIN;
+    ssize_t count = 0;
+    while (buffer_reserve(&window, TAIL_READ_SIZE) == 0 &&
+           (count = stream_read(in, window.data + window.length, TAIL_READ_SIZE)) > 0) {
+        window.length += count;
+        if (window.length < limit) {
+            continue;
+        }
+        size_t start = options->bytes ? (window.length > options->count ? window.length - options->count : 0)
+                                       : tail_line_start(window.data, window.length, options->count);
+        memmove(window.data, window.data + start, window.length - start);
+        window.length -= start;
+        limit = window.length * 2 > TAIL_WINDOW_MIN ? window.length * 2 : TAIL_WINDOW_MIN;
+    }
+    if (count == 0) {
+        size_t start = options->bytes ? (window.length > options->count ? window.length - options->count : 0)
+                                      : tail_line_start(window.data, window.length, options->count);
+        stream_write(out, window.data + start, window.length - start);
+    }
+    free(window.data);
+    return count == 0 ? 0 : -1;
+}
+
+// SIGINT ends the builtins that run until interrupted (tail -f, jtop). While one runs, the
+// handler writes to a pipe that each of them polls together with what it waits for, so one on
+// a worker thread wakes up as well.
+static pthread_mutex_t interrupt_lock = PTHREAD_MUTEX_INITIALIZER;
+static int interrupt_watchers;
+static int interrupt_wake[2] = {-1, -1};
+static struct sigaction interrupt_previous_action;
+
+static void interrupt_wakeup(int sig) {
+    (void)sig;
+    int saved = errno;
+    if (write(interrupt_wake[1], "", 1) < 0) {
+        // The pipe is full, so a wakeup is already pending.
+    }
+    errno = saved;
+}
+
+static int interrupt_watch_begin(void) {
+    pthread_mutex_lock(&interrupt_lock);
+    int result = 0;
+    if (interrupt_wake[0] < 0 && pipe2(interrupt_wake, O_CLOEXEC | O_NONBLOCK) < 0) {
+        result = -1;
+    } else if (interrupt_watchers++ == 0) {
+        char drain[64];
+        while (read(interrupt_wake[0], drain, sizeof(drain)) > 0) {
+        }
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = interrupt_wakeup;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGINT, &action, &interrupt_previous_action);
+    }
+    pthread_mutex_unlock(&interrupt_lock);
+    return result;
+}
+
+static void interrupt_watch_end(void) {
+    pthread_mutex_lock(&interrupt_lock);
+    if (--interrupt_watchers == 0) {
+        sigaction(SIGINT, &interrupt_previous_action, NULL);
+    }
+    pthread_mutex_unlock(&interrupt_lock);
+}
+
+// Function for watching the followed path, -1 with errno set on failure
+static int tail_watch(const char *name) {
+    int watch = inotify_init1(IN_CLOEXEC);
+    if (watch >= 0 && inotify_add_watch(watch, name, IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+        int error = errno;
+        close(watch);
+        errno = error;
+        return -1;
+    }
+    return watch;
+}
+
+// Function for tail -f: waits for inotify events on the file and copies whatever was appended
+// after `offset`, until SIGINT or the reader going away. Like tail -F, a file that is renamed
+// or deleted (log rotation) is followed under its name again once a new file appears there;
+// the path is checked every TAIL_FOLLOW_RECHECK ms, since an unlinked file still held open
+// sends no event of its own.
+static int tail_follow(int fd, const char *name, off_t offset, struct stream *out) {
+    int watch = tail_watch(name);
+    if (watch < 0) {
+        fprintf(stderr, "tail: %s: %s\n", name, strerror(errno));
+        return 1;
+    }
+    char *block = malloc(TAIL_READ_SIZE);
+    if (block == NULL || interrupt_watch_begin() < 0) {
+        perror("tail");
+        free(block);
+        close(watch);
+        return 1;
+    }
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int failed = 0, opened = -1;    // opened: a file this function opened after a rotation
+    while (!failed) {
+        struct pollfd fds[2] = {{watch, POLLIN, 0}, {interrupt_wake[0], POLLIN, 0}};
+        if (poll(fds, 2, TAIL_FOLLOW_RECHECK) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            failed = 1;
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            while (read(watch, events, sizeof(events)) < 0 && errno == EINTR) {
+            }
+        }
+        struct stat st, path_st;
+        int have_st = fd >= 0 && fstat(fd, &st) == 0;
+        if (fd >= 0) {
+            if (have_st && st.st_size < offset) {
+                fprintf(stderr, "tail: %s: file truncated\n", name);
+                offset = 0;
+            }
+            ssize_t count;
+            while ((count = pread(fd, block, TAIL_READ_SIZE, offset)) > 0) {
+                stream_write(out, block, count);
+                offset += count;
+            }
+        }
+        if (stream_flush(out) < 0) {
+            failed = 1;
+        }
+        int path_found = stat(name, &path_st) == 0;
+        if (have_st && (!path_found || path_st.st_dev != st.st_dev || path_st.st_ino != st.st_ino)) {
+            if (!path_found) {
+                fprintf(stderr, "tail: '%s' has become inaccessible: %s\n", name, strerror(errno));
+            }
+            if (opened >= 0) {
+                close(opened);
+            }
+            close(watch);
+            watch = -1;
+            fd = opened = -1;
+        }
+        if (fd < 0 && path_found && (opened = open(name, O_RDONLY | O_CLOEXEC)) >= 0) {
+            if ((watch = tail_watch(name)) < 0) {
+                close(opened);
+                opened = -1;
+                continue;
+            }
+            fprintf(stderr, "tail: '%s' has been replaced; following new file\n", name);
+            fd = opened;
+            offset = 0;
+        }
+    }
+    interrupt_watch_end();
+    free(block);
+    if (watch >= 0) {
+        close(watch);
+    }
+    if (opened >= 0) {
+        close(opened);
+    }
+    return failed;
+}
+
+// Function for one file of head or tail. Regular files are mapped without being read ahead,
+// so tail only touches the pages it prints.
+static int head_tail_file(const char *name, int tail, const char *path, int fd, struct stream *in,
+                          struct stream *out, const struct head_tail_options *options) {
+    struct mapped_file file;
+    if (fd < 0 || map_input_file_lazy(fd, &file) < 0) {
+        struct stream file_stream;
+        if (fd >= 0) {
+            stream_init(&file_stream, fd);
+            in = &file_stream;
+        }
+        if ((tail ? tail_stream(in, out, options) : head_stream(in, out, options)) < 0) {
+            fprintf(stderr, "%s: %s: %s\n", name, path, strerror(errno));
+            return 1;
+        }
+        if (tail && options->follow) {
+            fprintf(stderr, "tail: %s: cannot follow a pipe or other non-regular file\n", path);
+        }
+        return 0;
+    }
+    size_t start = 0, end = file.size;
+    if (tail) {
+        start = options->bytes ? (file.size > options->count ? file.size - options->count : 0)
+                               : tail_line_start(file.data, file.size, options->count);
+    } else {
+        size_t lines = options->count;
+        end = options->bytes ? (file.size < options->count ? file.size : options->count)
+                             : head_line_end(file.data, file.size, &lines);
+    }
+    stream_write(out, file.data + start, end - start);
+    unmap_input_file(&file);
+    if (tail && options->follow) {
+        stream_flush(out);
+        return tail_follow(fd, path, file.size, out);
+    }
+    return 0;
+}
+
+// Function for the head and tail builtins: head|tail [-n lines] [-c bytes] [file...]
+// tail -f keeps following a single regular file.
+static int head_tail(char **args, struct stream *in, struct stream *out, int tail) {
+    const char *name = tail ? "tail" : "head";
+    struct head_tail_options options;
+    memset(&options, 0, sizeof(options));
+    int a = head_tail_parse(name, args, &options);
+    if (a < 0) {
+        return 1;
+    }
+    int file_count = 0;
+    while (args[a + file_count] != NULL) {
+        file_count++;
+    }
+    if (options.follow && file_count != 1) {
+        fprintf(stderr, "tail: -f follows exactly one file\n");
+        return 1;
+    }
+    if (file_count == 0) {
+        return head_tail_file(name, tail, "standard input", -1, in, out, &options);
+    }
+    int failed = 0;
+    for (int f = 0; f < file_count; f++) {
+        const char *path = args[a + f];
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "%s: cannot open '%s' for reading: %s\n", name, path, strerror(errno));
+            failed = 1;
+            continue;
+        }
+        if (file_count > 1) {
+            stream_printf(out, "%s==> %s <==\n", f > 0 ? "\n" : "", path);
+        }
+        failed |= head_tail_file(name, tail, path, fd, in, out, &options);
+        close(fd);
+    }
+    return failed;
+}
+
+int builtin_head(char **args, struct stream *in, struct stream *out) {
+    return head_tail(args, in, out, 0);
+}
+
+int builtin_tail(char **args, struct stream *in, struct stream *out) {
+    return head_tail(args, in, out, 1);
+}
+
+// One output file of shard. Records are queued as iovecs pointing into the input and written
+// with a single writev per flush.
+struct shard_output {
+    int fd;
+    char *name;
+    struct iovec *iov;
+    int iov_count;
+    size_t bytes;
+    int error;      // errno of the first failed write
+};
+
+struct shard_state {
+    struct shard_output *shards;
+    int count;
+    int field;          // -f: records are sharded by the hash of this field, else round-robin
+    char separator;
+    char delimiter;     // Record delimiter, '\n' or '\0' with -z
+    size_t next;        // Round-robin position
+    struct task_group group;
+};
+
+// Function for writing a whole iovec array, retrying short writes
+static int writev_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+static void shard_flush(struct shard_output *shard) {
+    if (shard->iov_count > 0 && !shard->error && writev_all(shard->fd, shard->iov, shard->iov_count) < 0) {
+        shard->error = errno;
+    }
+    shard->iov_count = 0;
+}
+
+static void shard_flush_task(void *arg) {
+    shard_flush(arg);
+}
+
+// Function for writing out every shard at once, one pool task per file
+static void shard_flush_all(struct shard_state *state) {
+    for (int s = 0; s < state->count; s++) {
+        if (state->shards[s].iov_count > 0) {
+            thread_pool_submit(&state->group, shard_flush_task, &state->shards[s]);
+        }
+    }
+    task_group_wait(&state->group);
+}
+
+// Function for queueing the records of a block on their shards. Stops after SHARD_BLOCK_SIZE
+// bytes; a last record without delimiter is only taken when final is set. Returns the bytes used.
+static size_t shard_records(struct shard_state *state, const char *data, size_t length, int final) {
+    size_t position = 0;
+    while (position < length && position < SHARD_BLOCK_SIZE) {
+        const char *end = memchr(data + position, state->delimiter, length - position);
+        if (end == NULL && !final) {
+            break;
+        }
+        const char *record = data + position;
+        size_t record_length = (end != NULL ? (size_t)(end - record) + 1 : length - position);
+        position += record_length;
+
+        size_t s;
+        if (state->field > 0) {
+            size_t key_length = 0;
+            size_t line_length = record_length - (end != NULL);
+            const char *key = line_field(record, line_length, state->separator, state->field, &key_length);
+            s = hash_bytes(key != NULL ? key : "", key_length) % state->count;
+        } else {
+            s = state->next++ % state->count;
+        }
+        struct shard_output *shard = &state->shards[s];
+        shard->bytes += record_length;
+        struct iovec *last = shard->iov_count > 0 ? &shard->iov[shard->iov_count - 1] : NULL;
+        if (last != NULL && (char *)last->iov_base + last->iov_len == record) {
+            last->iov_len += record_length;     // Neighbouring records go out as one piece
+            continue;
+        }
+        if (shard->iov_count == IOV_MAX) {
+            shard_flush(shard);
+        }
+        shard->iov[shard->iov_count++] = (struct iovec){(void *)record, record_length};
+    }
+    return position;
+}
+
+// Function for sharding a stream; the block is written out before it is reused
+static int shard_stream(struct shard_state *state, struct stream *in) {
+    struct byte_buffer block = {NULL, 0, 0};
+    ssize_t count = 1;
+    int result = 0;
+    while (count > 0) {
+        if (buffer_reserve(&block, SHARD_BLOCK_SIZE) < 0) {
+            result = -1;
+            break;
+        }
+        count = stream_read(in, block.data + block.length, block.capacity - block.length);
+        if (count < 0) {
+            result = -1;
+            break;
+        }
+        block.length += count;
+        size_t used = 0, step;
+        while ((step = shard_records(state, block.data + used, block.length - used, count == 0)) > 0) {
+            used += step;
+        }
+        shard_flush_all(state);
+        memmove(block.data, block.data + used, block.length - used);
+        block.length -= used;
+    }
+    free(block.data);
+    return result;
+}
+
+// Function for checking that a file name template has exactly one %d (optionally %0Nd)
+static int shard_check_template(const char *template) {
+    int conversions = 0;
+    for (const char *p = template; *p; p++) {
+        if (*p != '%') {
+            continue;
+        }
+        if (*++p == '%') {
+            continue;
+        }
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+        if (*p != 'd') {
+            return -1;
+        }
+        conversions++;
+    }
+    return conversions == 1 ? 0 : -1;
+}
+
+// Function for the shard builtin: shard -n N [-f field] [-t sep] [-z] [-o template] [file...]
+// Writes every record to one of N files (template, default "shard.%d"), chosen by the hash of a
+// field or round-robin, and prints the number of bytes that went to each file.
+int builtin_shard(char **args, struct stream *in, struct stream *out) {
+    struct shard_state state;
+    memset(&state, 0, sizeof(state));
+    pthread_mutex_init(&state.group.lock, NULL);
+    pthread_cond_init(&state.group.done, NULL);
+    state.delimiter = '\n';
+    const char *template = "shard.%d";
+    int a = 1;
+    for (; args[a] != NULL && args[a][0] == '-' && args[a][1] != '\0'; a++) {
+        char flag = args[a][1];
+        if (flag == 'z' && args[a][2] == '\0') {
+            state.delimiter = '\0';
+            continue;
+        }
+        const char *value = args[a][2] != '\0' ? args[a] + 2 : args[++a];
+        if ((flag != 'n' && flag != 'f' && flag != 't' && flag != 'o') || value == NULL) {
+            fprintf(stderr, "Usage: shard -n N [-f field] [-t sep] [-z] [-o template] [file...]\n");
+            return 1;
+        }
+        if (flag == 'n') {
+            state.count = atoi(value);
+        } else if (flag == 'f') {
+            state.field = atoi(value);
+        } else if (flag == 't') {
+            state.separator = value[0];
+        } else {
+            template = value;
+        }
+    }
+    if (state.count < 1 || state.count > SHARD_MAX_FILES) {
+        fprintf(stderr, "shard: the number of shards must be between 1 and %d\n", SHARD_MAX_FILES);
+        return 1;
+    }
+    if (shard_check_template(template) < 0) {
+        fprintf(stderr, "shard: the file name template needs exactly one %%d: %s\n", template);
+        return 1;
+    }
+
+    state.shards = calloc(state.count, sizeof(*state.shards));
+    int failed = state.shards == NULL;
+    for (int s = 0; s < state.count && !failed; s++) {
+        struct shard_output *shard = &state.shards[s];
+        int length = snprintf(NULL, 0, template, s);
+        shard->name = malloc(length + 1);
+        shard->iov = malloc(IOV_MAX * sizeof(*shard->iov));
+        shard->fd = -1;
+        if (shard->name == NULL || shard->iov == NULL) {
+            failed = 1;
+            break;
+        }
+        snprintf(shard->name, length + 1, template, s);
+        shard->fd = open(shard->name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (shard->fd < 0) {
+            fprintf(stderr, "shard: %s: %s\n", shard->name, strerror(errno));
+            failed = 1;
+        }
+    }
+
+    if (!failed && args[a] == NULL && shard_stream(&state, in) < 0) {
+        perror("shard");
+        failed = 1;
+    }
+    for (; !failed && args[a] != NULL; a++) {
+        int fd = open(args[a], O_RDONLY | O_CLOEXEC);
+        struct mapped_file file;
+        if (fd < 0) {
+            fprintf(stderr, "shard: %s: %s\n", args[a], strerror(errno));
+            failed = 1;
+        } else if (map_input_file(fd, &file) == 0) {
+            for (size_t used = 0; used < file.size;) {
+                used += shard_records(&state, file.data + used, file.size - used, 1);
+                shard_flush_all(&state);
+            }
+            unmap_input_file(&file);
+        } else {
+            struct stream file_stream;
+            stream_init(&file_stream, fd);
+            if (shard_stream(&state, &file_stream) < 0) {
+                fprintf(stderr, "shard: %s: %s\n", args[a], strerror(errno));
+                failed = 1;
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    for (int s = 0; state.shards != NULL && s < state.count; s++) {
+        struct shard_output *shard = &state.shards[s];
+        if (shard->error) {
+            fprintf(stderr, "shard: %s: %s\n", shard->name, strerror(shard->error));
+            failed = 1;
+        }
+        if (!failed) {
+            stream_printf(out, "%10zu %s\n", shard->bytes, shard->name);
+        }
+        if (shard->fd >= 0) {
+            close(shard->fd);
+        }
+        free(shard->name);
+        free(shard->iov);
+    }
+    free(state.shards);
+    return failed;
+}
+
+int is_builtin_command(const char *name);
+int execute_builtin_command(char **args, struct stream *in, struct stream *out);
+
+// Function for the last step of a forked child. These children are forked from pool threads
+// (fanout and xargs lanes, coproc), and a lock another thread held at the fork (stdio, the
+// trace, the metric shards, the history) would stay locked in the child forever. So a builtin
+// runs in a fresh copy of the shell, started with --builtin; anything else is executed.
+static void run_command_in_child(char **argv) {
+    signal(SIGPIPE, SIG_DFL);
+    if (is_builtin_command(argv[0])) {
+        char *shell_argv[MAX_ARGS + 3] = {"myshell", "--builtin"};
+        for (int i = 0; argv[i] != NULL && i < MAX_ARGS; i++) {
+            shell_argv[i + 2] = argv[i];
+        }
+        execv("/proc/self/exe", shell_argv);
+        perror("execv");
+        _exit(126);
+    }
+    execvp(argv[0], argv);
+    perror("execvp");
+    _exit(127);
+}
+
+// One child process of fanout
+struct fanout_child {
+    pid_t pid;                  // 0 while the slot is free
+    int in_fd, out_fd;          // -1 once closed
+    struct byte_buffer input;   // Chunk being written to the child
+    size_t written;
+    struct byte_buffer output;  // What the child printed and was not passed on yet
+    size_t sequence;            // -k: number of the chunk this child handles
+    int finished;               // -k: output complete and the child reaped
+};
+
+// Function for starting one fanout child on a pair of pipes. The child first closes the pipes
+// of its siblings, so that their input still ends when the shell closes it.
+static int fanout_spawn(struct fanout_child *child, struct fanout_child *children, int count, char **argv) {
+    int to_child[2], from_child[2];
+    if (pipe2(to_child, O_CLOEXEC) < 0) {
+        return -1;
+    }
+    if (pipe2(from_child, O_CLOEXEC) < 0) {
+        close(to_child[0]);
+        close(to_child[1]);
+        return -1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        for (int c = 0; c < count; c++) {
+            if (children[c].in_fd >= 0) {
+                close(children[c].in_fd);
+            }
+            if (children[c].out_fd >= 0) {
+                close(children[c].out_fd);
+            }
+        }
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        close(to_child[0]);
+        close(to_child[1]);
+        close(from_child[0]);
+        close(from_child[1]);
+        run_command_in_child(argv);
+    }
+    close(to_child[0]);
+    close(from_child[1]);
+    if (pid < 0) {
+        close(to_child[1]);
+        close(from_child[0]);
+        return -1;
+    }
+    fcntl(to_child[1], F_SETFL, O_NONBLOCK);
+    child->pid = pid;
+    child->in_fd = to_child[1];
+    child->out_fd = from_child[0];
+    child->input.length = child->written = child->output.length = 0;
+    child->finished = 0;
+    return 0;
+}
+
+// Function for reaping a fanout child, returns its exit status
+static int fanout_reap(struct fanout_child *child) {
+    int status = 0;
+    while (waitpid(child->pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    child->pid = 0;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+static void fanout_close(int *fd) {
+    if (*fd >= 0) {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+// Function for cutting the next chunk off the pending input: whole records up to chunk_size
+// bytes, a longer record whole, and at the end of the input whatever is left.
+static size_t fanout_next_chunk(const struct byte_buffer *pending, size_t chunk_size, char delimiter, int input_done) {
+    size_t limit = pending->length < chunk_size ? pending->length : chunk_size;
+    const char *end = limit > 0 ? memrchr(pending->data, delimiter, limit) : NULL;
+    if (end != NULL) {
+        return end - pending->data + 1;
+    }
+    end = pending->length > limit ? memchr(pending->data + limit, delimiter, pending->length - limit) : NULL;
+    if (end != NULL) {
+        return end - pending->data + 1;
+    }
+    return input_done ? pending->length : 0;
+}
+
+// Function for the fanout builtin: fanout [-j N] [-k] [-z] command [arg...]
+// Splits the input at line (-z: NUL) boundaries and hands the chunks to N processes running the
+// command, each chunk to whichever process is idle. Their output is merged a line at a time.
+// -k keeps the output in input order: every chunk then gets a process of its own, and the output
+// of each is passed on once all earlier chunks are done.
+int builtin_fanout(char **args, struct stream *in, struct stream *out) {
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int ordered = 0, a = 1;
+    char delimiter = '\n';
+    for (; args[a] != NULL && args[a][0] == '-' && args[a][1] != '\0'; a++) {
+        if (strcmp(args[a], "-k") == 0) {
+            ordered = 1;
+        } else if (strcmp(args[a], "-z") == 0) {
+            delimiter = '\0';
+        } else if (strncmp(args[a], "-j", 2) == 0) {
+            const char *value = args[a][2] != '\0' ? args[a] + 2 : args[++a];
+            jobs = value != NULL ? strtol(value, NULL, 10) : 0;
+            if (jobs < 1) {
+                fprintf(stderr, "fanout: invalid number of jobs\n");
+                return 1;
+            }
+        } else {
+            break;
+        }
+    }
+    if (args[a] == NULL) {
+        fprintf(stderr, "Usage: fanout [-j N] [-k] [-z] command [arg...]\n");
+        return 1;
+    }
+    if (jobs < 1) {
+        jobs = 1;
+    }
+    char **argv = args + a;
+    size_t chunk_size = ordered ? FANOUT_ORDERED_CHUNK_SIZE : FANOUT_CHUNK_SIZE;
+    struct fanout_child *children = calloc(jobs, sizeof(*children));
+    struct byte_buffer pending = {NULL, 0, 0};
+    if (children == NULL) {
+        perror("fanout");
+        return 1;
+    }
+    for (long c = 0; c < jobs; c++) {
+        children[c].in_fd = children[c].out_fd = -1;
+    }
+    int result = 0, failed = 0, input_done = 0;
+    if (!ordered) {
+        for (long c = 0; c < jobs && !failed; c++) {
+            failed = fanout_spawn(&children[c], children, jobs, argv) < 0;
+        }
+    }
+    size_t next_sequence = 0, next_output = 0;
+    int running = ordered ? 0 : (int)jobs;
+
+    while (!failed) {
+        // In order, pass on the output of chunks that are complete.
+        for (int progress = 1; ordered && progress;) {
+            progress = 0;
+            for (long c = 0; c < jobs; c++) {
+                if (children[c].finished && children[c].sequence == next_output) {
+                    stream_write(out, children[c].output.data, children[c].output.length);
+                    children[c].finished = 0;
+                    children[c].output.length = 0;
+                    next_output++;
+                    progress = 1;
+                }
+            }
+        }
+        // Hand chunks to idle children (in -k mode: to free slots, with a new process).
+        for (long c = 0; c < jobs; c++) {
+            struct fanout_child *child = &children[c];
+            int idle = ordered ? child->pid == 0 && !child->finished : child->in_fd >= 0 && child->written == child->input.length;
+            if (!idle) {
+                continue;
+            }
+            size_t length = fanout_next_chunk(&pending, chunk_size, delimiter, input_done);
+            if (length == 0) {
+                if (input_done && !ordered) {
+                    fanout_close(&child->in_fd);     // No more input for this child
+                }
+                continue;
+            }
+            if (ordered) {
+                if (fanout_spawn(child, children, jobs, argv) < 0) {
+                    failed = 1;
+                    break;
+                }
+                child->sequence = next_sequence++;
+                running++;
+            }
+            child->input.length = child->written = 0;
+            if (buffer_append(&child->input, pending.data, length) < 0) {
+                failed = 1;
+                break;
+            }
+            memmove(pending.data, pending.data + length, pending.length - length);
+            pending.length -= length;
+        }
+        if (running == 0 && (!ordered || (input_done && pending.length == 0))) {
+            break;
+        }
+
+        struct pollfd fds[2 * jobs + 1];
+        int fd_count = 0;
+        int want_input = !input_done && pending.length < chunk_size;
+        if (want_input && in->ring != NULL) {
+            // A fused builtin stage cannot be polled; read it once a child is waiting for work.
+            int waiting = 0;
+            for (long c = 0; c < jobs; c++) {
+                waiting |= ordered ? children[c].pid == 0 && !children[c].finished
+                                   : children[c].in_fd >= 0 && children[c].written == children[c].input.length;
+            }
+            if (waiting) {
+                if (buffer_reserve(&pending, FANOUT_READ_SIZE) < 0) {
+                    failed = 1;
+                    break;
+                }
+                ssize_t count = stream_read(in, pending.data + pending.length, FANOUT_READ_SIZE);
+                input_done = count <= 0;
+                pending.length += count > 0 ? count : 0;
+                continue;
+            }
+            want_input = 0;
+        }
+        if (want_input) {
+            fds[fd_count++] = (struct pollfd){in->fd, POLLIN, 0};
+        }
+        for (long c = 0; c < jobs; c++) {
+            if (children[c].in_fd >= 0 && children[c].written < children[c].input.length) {
+                fds[fd_count++] = (struct pollfd){children[c].in_fd, POLLOUT, 0};
+            }
+            if (children[c].out_fd >= 0) {
+                fds[fd_count++] = (struct pollfd){children[c].out_fd, POLLIN, 0};
+            }
+        }
+        if (fd_count == 0) {
+            continue;
+        }
+        if (poll(fds, fd_count, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            failed = 1;
+            break;
+        }
+        int f = 0;
+        if (want_input && fds[f++].revents) {
+            if (buffer_reserve(&pending, FANOUT_READ_SIZE) < 0) {
+                failed = 1;
+                break;
+            }
+            ssize_t count = stream_read(in, pending.data + pending.length, FANOUT_READ_SIZE);
+            input_done = count <= 0;
+            pending.length += count > 0 ? count : 0;
+        }
+        for (long c = 0; c < jobs; c++) {
+            struct fanout_child *child = &children[c];
+            if (child->in_fd >= 0 && child->written < child->input.length && fds[f++].revents) {
+                ssize_t count = write(child->in_fd, child->input.data + child->written,
+                                      child->input.length - child->written);
+                if (count > 0) {
+                    child->written += count;
+                } else if (errno != EAGAIN && errno != EINTR) {
+                    child->written = child->input.length;    // The child stopped reading
+                    fanout_close(&child->in_fd);
+                }
+                if (ordered && child->written == child->input.length) {
+                    fanout_close(&child->in_fd);             // One chunk per process
+                }
+            }
+            if (child->out_fd >= 0 && fds[f++].revents) {
+                if (buffer_reserve(&child->output, FANOUT_READ_SIZE) < 0) {
+                    failed = 1;
+                    break;
+                }
+                ssize_t count = read(child->out_fd, child->output.data + child->output.length, FANOUT_READ_SIZE);
+                if (count < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (count > 0) {
+                    child->output.length += count;
+                    if (!ordered) {
+                        // Only whole records are passed on, so lines of different children never mix.
+                        const char *end = memrchr(child->output.data, delimiter, child->output.length);
+                        size_t length = end != NULL ? (size_t)(end - child->output.data + 1) : 0;
+                        stream_write(out, child->output.data, length);
+                        memmove(child->output.data, child->output.data + length, child->output.length - length);
+                        child->output.length -= length;
+                    }
+                    continue;
+                }
+                fanout_close(&child->out_fd);
+                fanout_close(&child->in_fd);
+                int status = fanout_reap(child);
+                result = status > result ? status : result;
+                running--;
+                if (ordered) {
+                    child->finished = 1;
+                } else {
+                    stream_write(out, child->output.data, child->output.length);
+                    child->output.length = 0;
+                    child->written = child->input.length;
+                }
+            }
+        }
+        if (stream_flush(out) < 0) {
+            failed = 1;         // The reader is gone
+        }
+    }
+
+    for (long c = 0; c < jobs; c++) {
+        fanout_close(&children[c].in_fd);
+        fanout_close(&children[c].out_fd);
+        if (children[c].pid > 0) {
+            kill(children[c].pid, SIGTERM);
+            fanout_reap(&children[c]);
+        }
+        free(children[c].input.data);
+        free(children[c].output.data);
+    }
+    free(children);
+    free(pending.data);
+    return failed ? 1 : result;
+}
+
+// Trace of set -x, also written by xargs -t. Lines are collected in a buffer and written to the
+// file descriptor named by XTRACEFD (standard error by default) when it fills up, before every
+// prompt and at exit, so tracing a command costs a copy rather than a write.
+struct xtrace {
+    atomic_int enabled;             // set -x
+    atomic_int timing;              // set -o xtime: duration and exit status after each command
+    int fd;                         // -1 until the first flush
+    pid_t pid;                      // A forked child drops what it inherited in the buffer
+    pthread_mutex_t lock;
+    size_t length;
+    char buffer[XTRACE_BUFFER_SIZE];
+} xtrace = {0, 0, -1, 0, PTHREAD_MUTEX_INITIALIZER, 0, {0}};
+
+// Function for writing out the trace buffer, with the lock held
+static void xtrace_flush_locked(void) {
+    if (xtrace.pid != getpid()) {
+        xtrace.pid = getpid();
+        xtrace.length = 0;
+    }
+    if (xtrace.length == 0) {
+        return;
+    }
+    if (xtrace.fd < 0) {
+        char *name = getenv("XTRACEFD");
+        xtrace.fd = name != NULL && name[0] != '\0' ? atoi(name) : STDERR_FILENO;
+    }
+    write_all(xtrace.fd, xtrace.buffer, xtrace.length);
+    xtrace.length = 0;
+}
+
+// Function for writing out the trace buffer
+void xtrace_flush(void) {
+    pthread_mutex_lock(&xtrace.lock);
+    xtrace_flush_locked();
+    pthread_mutex_unlock(&xtrace.lock);
+}
+
+// Function for appending to the trace buffer, with the lock held (text longer than the buffer
+// is written directly)
+static void xtrace_append_locked(const char *text, size_t length) {
+    if (xtrace.pid != getpid() || xtrace.length + length > sizeof(xtrace.buffer)) {
+        xtrace_flush_locked();
+    }
+    if (length > sizeof(xtrace.buffer)) {
+        write_all(xtrace.fd >= 0 ? xtrace.fd : STDERR_FILENO, text, length);
+        return;
+    }
+    memcpy(xtrace.buffer + xtrace.length, text, length);
+    xtrace.length += length;
+}
+
+// Function for adding a formatted line to the trace
+void xtrace_printf(const char *format, ...) {
+    char line[1024];
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(line, sizeof(line), format, arguments);
+    va_end(arguments);
+    if (length < 0) {
+        return;
+    }
+    pthread_mutex_lock(&xtrace.lock);
+    xtrace_append_locked(line, (size_t)length < sizeof(line) ? (size_t)length : sizeof(line) - 1);
+    pthread_mutex_unlock(&xtrace.lock);
+}
+
+// Function for adding a command to the trace: prefix, then the words separated by spaces
+void xtrace_words(const char *prefix, char **words, int count) {
+    pthread_mutex_lock(&xtrace.lock);
+    xtrace_append_locked(prefix, strlen(prefix));
+    for (int w = 0; w < count && words[w] != NULL; w++) {
+        xtrace_append_locked(" ", 1);
+        xtrace_append_locked(words[w], strlen(words[w]));
+    }
+    xtrace_append_locked("\n", 1);
+    pthread_mutex_unlock(&xtrace.lock);
+}
+
+// Function for the monotonic time stamps of the trace, in seconds
+double xtrace_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Function for the set builtin: set -x / set +x turn the trace on and off, set -o xtime /
+// set +o xtime add the duration and exit status of each command; set alone shows both
+int builtin_set(char **args, struct stream *out) {
+    if (args[1] == NULL) {
+        stream_printf(out, "xtrace %s\nxtime %s\n", atomic_load(&xtrace.enabled) ? "on" : "off",
+                      atomic_load(&xtrace.timing) ? "on" : "off");
+        return 0;
+    }
+    for (int a = 1; args[a] != NULL; a++) {
+        int on = args[a][0] == '-';
+        if (strcmp(args[a] + 1, "x") == 0 && (on || args[a][0] == '+')) {
+            atomic_store(&xtrace.enabled, on);
+        } else if (strcmp(args[a] + 1, "o") == 0 && (on || args[a][0] == '+') && args[a + 1] != NULL &&
+                   strcmp(args[a + 1], "xtime") == 0) {
+            atomic_store(&xtrace.timing, on);
+            a++;
+        } else {
+            fprintf(stderr, "set: unknown option %s\n", args[a]);
+            return 1;
+        }
+    }
+    if (!atomic_load(&xtrace.enabled)) {
+        xtrace_flush();
+    }
+    return 0;
+}
+
+// Function for formatting nanoseconds with a unit that keeps them short
+static void format_duration(char *text, size_t size, uint64_t nanoseconds) {
+    if (nanoseconds < 1000) {
+        snprintf(text, size, "%lluns", (unsigned long long)nanoseconds);
+    } else if (nanoseconds < 1000000) {
+        snprintf(text, size, "%.1fus", nanoseconds / 1e3);
+    } else if (nanoseconds < 1000000000) {
+        snprintf(text, size, "%.1fms", nanoseconds / 1e6);
+    } else {
+        snprintf(text, size, "%.2fs", nanoseconds / 1e9);
+    }
+}
+
+// Function for the stats builtin: stats [--reset] prints the shell's counters and the
+// percentiles of its latency histograms, or clears them all
+int builtin_stats(char **args, struct stream *out) {
+    if (args[1] != NULL) {
+        if (strcmp(args[1], "--reset") != 0) {
+            fprintf(stderr, "Usage: stats [--reset]\n");
+            return 1;
+        }
+        metrics_reset();
+        return 0;
+    }
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+        stream_printf(out, "%-16s %llu\n", counter_names[c], (unsigned long long)metric_counter_total(c));
+    }
+    stream_printf(out, "\n%-16s %8s %9s %9s %9s %9s %9s\n", "histogram", "count", "mean", "p50", "p99", "p999", "max");
+    struct metric_summary *summary = malloc(sizeof(*summary));
+    if (summary == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for (int h = 0; h < HISTOGRAM_COUNT; h++) {
+        metric_merge(h, summary);
+        char values[5][16];
+        format_duration(values[0], sizeof(values[0]), summary->count != 0 ? summary->sum / summary->count : 0);
+        format_duration(values[1], sizeof(values[1]), metric_percentile(summary, 0.5));
+        format_duration(values[2], sizeof(values[2]), metric_percentile(summary, 0.99));
+        format_duration(values[3], sizeof(values[3]), metric_percentile(summary, 0.999));
+        format_duration(values[4], sizeof(values[4]), metric_percentile(summary, 1.0));
+        stream_printf(out, "%-16s %8llu %9s %9s %9s %9s %9s\n", histogram_names[h], (unsigned long long)summary->count,
+                      values[0], values[1], values[2], values[3], values[4]);
+    }
+    free(summary);
+    return 0;
+}
+
+// Function for rendering the metrics registry in the OpenMetrics text format, returns the length
+// (the text is cut short if it does not fit)
+size_t metrics_render(char *text, size_t size, struct metric_summary *summary) {
+    static const double bounds[] = {1e-6, 1e-5, 1e-4, 1e-3, 1e-2, 1e-1, 1, 10};   // Seconds
+    size_t length = 0;
+#define RENDER(...) (length += length < size ? (size_t)snprintf(text + length, size - length, __VA_ARGS__) : 0)
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+        RENDER("# TYPE myshell_%s counter\nmyshell_%s_total %llu\n", counter_names[c], counter_names[c],
+               (unsigned long long)metric_counter_total(c));
+    }
+    RENDER("# TYPE myshell_active_jobs gauge\nmyshell_active_jobs %d\n", atomic_load(&active_jobs));
+    for (int h = 0; h < HISTOGRAM_COUNT; h++) {
+        metric_merge(h, summary);
+        RENDER("# TYPE myshell_%s_seconds histogram\n", histogram_names[h]);
+        uint64_t cumulative = 0, width;
+        int b = 0;
+        for (size_t i = 0; i < sizeof(bounds) / sizeof(bounds[0]); i++) {
+            // A bucket counts towards a bound once all of its values are below it
+            while (b < METRIC_BUCKETS && metric_bucket_start(b, &width) + width <= bounds[i] * 1e9) {
+                cumulative += summary->buckets[b++];
+            }
+            RENDER("myshell_%s_seconds_bucket{le=\"%g\"} %llu\n", histogram_names[h], bounds[i], (unsigned long long)cumulative);
+        }
+        RENDER("myshell_%s_seconds_bucket{le=\"+Inf\"} %llu\n", histogram_names[h], (unsigned long long)summary->count);
+        RENDER("myshell_%s_seconds_sum %.9f\nmyshell_%s_seconds_count %llu\n", histogram_names[h], summary->sum / 1e9,
+               histogram_names[h], (unsigned long long)summary->count);
+    }
+    RENDER("# EOF\n");
+#undef RENDER
+    return length < size ? length : size - 1;
+}
+
+// Metrics exporter, started when MYSHELL_METRICS_TEXTFILE (a path for the node exporter's
+// textfile collector) or MYSHELL_METRICS_SOCKET (a Unix socket serving each connection one
+// rendering, as an HTTP response when it sends a GET) is set. It runs on a thread of its own
+// and only reads the metric shards, so it never holds up the executor.
+struct metrics_exporter {
+    const char *textfile;
+    int listen_fd;                  // -1 without a socket
+    int interval;                   // Seconds between two writes of the textfile
+    char socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    pid_t owner;                    // Only the shell that bound the socket removes it
+};
+
+#define METRICS_SEND_TIMEOUT 1      // Seconds a client that does not read may hold up the exporter
+
+// Function for replacing the textfile in one rename, so a scrape never sees half of it
+static void metrics_write_textfile(const char *path, const char *text, size_t length) {
+    char temporary[PATH_MAX];
+    snprintf(temporary, sizeof(temporary), "%s.%d.tmp", path, (int)getpid());
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    int failed = write_all(fd, text, length) < 0;
+    close(fd);
+    if (failed || rename(temporary, path) < 0) {
+        unlink(temporary);
+    }
+}
+
+// Function for answering one connection on the metrics socket
+static void metrics_serve(int fd, const char *text, size_t length) {
+    char request[512];
+    struct pollfd readable = {fd, POLLIN, 0};
+    ssize_t count = poll(&readable, 1, 100) > 0 ? read(fd, request, sizeof(request)) : 0;
+    if (count >= 4 && memcmp(request, "GET ", 4) == 0) {
+        char header[160];
+        int header_length = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: "
+                                     "application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                                     "Content-Length: %zu\r\n\r\n", length);
+        write_all(fd, header, header_length);
+    }
+    write_all(fd, text, length);
+}
+
+// Function for the exporter thread
+static void *metrics_exporter_thread(void *arg) {
+    struct metrics_exporter *exporter = arg;
+    size_t size = 1 << 16;
+    char *text = malloc(size);
+    struct metric_summary *summary = malloc(sizeof(*summary));
+    if (text == NULL || summary == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    uint64_t next_write = 0;
+    while (1) {
+        uint64_t now = metric_now();
+        if (exporter->textfile != NULL && now >= next_write) {
+            metrics_write_textfile(exporter->textfile, text, metrics_render(text, size, summary));
+            next_write = now + (uint64_t)exporter->interval * 1000000000ULL;
+        }
+        if (exporter->listen_fd < 0) {
+            sleep(exporter->interval);
+            continue;
+        }
+        struct pollfd listening = {exporter->listen_fd, POLLIN, 0};
+        int timeout = -1;   // Without a textfile there is nothing to wake up for
+        if (exporter->textfile != NULL) {
+            int64_t remaining = (int64_t)(next_write - metric_now());
+            timeout = remaining > 0 ? (int)(remaining / 1000000) : 0;
+        }
+        if (poll(&listening, 1, timeout) > 0) {
+            int fd = accept4(exporter->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            struct timeval send_timeout = {METRICS_SEND_TIMEOUT, 0};
+            if (fd >= 0 && setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout)) == 0) {
+                metrics_serve(fd, text, metrics_render(text, size, summary));
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+    return NULL;
+}
+
+static struct metrics_exporter exporter;
+
+// Function for removing the metrics socket at exit
+static void metrics_remove_socket(void) {
+    if (exporter.listen_fd >= 0 && exporter.owner == getpid()) {
+        unlink(exporter.socket_path);
+    }
+}
+
+// Function for starting the exporter if the environment asks for one
+void start_metrics_exporter(void) {
+    const char *textfile = getenv("MYSHELL_METRICS_TEXTFILE");
+    const char *socket_path = getenv("MYSHELL_METRICS_SOCKET");
+    const char *interval = getenv("MYSHELL_METRICS_INTERVAL");
+    exporter.textfile = textfile != NULL && textfile[0] != '\0' ? textfile : NULL;
+    exporter.listen_fd = -1;
+    exporter.interval = interval != NULL && atoi(interval) > 0 ? atoi(interval) : 15;
+    if (socket_path != NULL && socket_path[0] != '\0') {
+        struct sockaddr_un address = {.sun_family = AF_UNIX};
+        if (strlen(socket_path) >= sizeof(address.sun_path)) {
+            fprintf(stderr, "Error: Metrics socket path too long\n");
+            return;
+        }
+        strcpy(address.sun_path, socket_path);
+        unlink(socket_path);    // Left behind by an earlier shell
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, 16) < 0) {
+            perror(socket_path);
+            if (fd >= 0) {
+                close(fd);
+            }
+            return;
+        }
+        exporter.listen_fd = fd;
+        strcpy(exporter.socket_path, socket_path);
+        exporter.owner = getpid();
+        atexit(metrics_remove_socket);
+    }
+    if (exporter.textfile == NULL && exporter.listen_fd < 0) {
+        return;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, metrics_exporter_thread, &exporter) != 0) {
+        perror("pthread_create");
+        return;
+    }
+    pthread_detach(thread);
+}
+
+// One command line built by xargs. argv and its strings live in the xargs arena, or with -P
+// in the batch's own arena, which the lane frees after running it.
+struct xargs_batch {
+    char **argv;
+    int argc;
+    size_t sequence;
+    struct arena arena;
+    struct xargs_batch *next;
+};
+
+struct xargs_state {
+    struct arena arena;     // Items, argv and batch being collected; only the reading thread allocates
+    char **command;         // The command and its initial arguments
+    int command_count;
+    size_t command_bytes;
+    const char *replace;    // -I: string replaced by the input line in the initial arguments
+    size_t max_args;        // -n
+    size_t max_bytes;       // ARG_MAX less the environment
+    int trace;              // -t
+    int empty_run;          // Run the command once when there is no input (no -r)
+    int whole_records;      // -0 and -I: every record is one item
+    struct byte_buffer items;   // char * of the batch being collected
+    size_t batch_bytes;
+    size_t batches;
+    int lanes;                  // -P: batches running at once
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t space;       // Signalled when a lane takes a batch off the queue
+    struct xargs_batch *head, *tail;
+    int queued;                 // Batches in the queue; the reader waits at 2 * lanes
+    int input_done;
+    struct stream *out;
+    pthread_mutex_t out_lock;
+    atomic_int status;
+};
+
+// Function for giving one batch's timing to the trace log (stderr)
+static void xargs_trace(struct xargs_state *state, const struct xargs_batch *batch, double milliseconds, int status) {
+    xtrace_printf("xargs: batch %zu: %d arguments, %.3f ms, exit %d\n", batch->sequence,
+                  batch->argc - state->command_count, milliseconds, status);
+}
+
+// Function for running one batch as a child process and waiting for it. The child's stdin is
+// /dev/null. Its stdout is the builtin's output: the file descriptor itself, or a pipe copied
+// into the ring when xargs feeds another builtin.
+static int xargs_run_batch(struct xargs_state *state, struct xargs_batch *batch) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (state->trace) {
+        xtrace_words("+", batch->argv, batch->argc);
+    }
+    int through_pipe = state->out->ring != NULL;
+    int output[2] = {-1, -1};
+    if (through_pipe && pipe2(output, O_CLOEXEC) < 0) {
+        perror("xargs: pipe");
+        return 126;
+    }
+    if (!through_pipe) {
+        pthread_mutex_lock(&state->out_lock);
+        stream_flush(state->out);
+        pthread_mutex_unlock(&state->out_lock);
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            close(null_fd);
+        }
+        dup2(through_pipe ? output[1] : state->out->fd, STDOUT_FILENO);
+        run_command_in_child(batch->argv);
+    }
+    if (through_pipe) {
+        close(output[1]);
+    }
+    if (pid < 0) {
+        perror("xargs: fork");
+        if (through_pipe) {
+            close(output[0]);
+        }
+        return 126;
+    }
+    if (through_pipe) {
+        char block[STREAM_BUFFER_SIZE];
+        ssize_t count;
+        while ((count = read(output[0], block, sizeof(block))) > 0 || (count < 0 && errno == EINTR)) {
+            if (count > 0) {
+                pthread_mutex_lock(&state->out_lock);
+                stream_write(state->out, block, count);
+                pthread_mutex_unlock(&state->out_lock);
+            }
+        }
+        close(output[0]);
+    }
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    int result = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (state->trace) {
+        xargs_trace(state, batch, (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6, result);
+    }
+    // Exit status like GNU xargs: 127 not found, 125 killed, 123 any other failure.
+    int code = !WIFEXITED(status) ? 125 : result == 127 || result == 126 ? result : result != 0 ? 123 : 0;
+    int previous = atomic_load(&state->status);
+    while (code > previous && !atomic_compare_exchange_weak(&state->status, &previous, code)) {
+    }
+    return code;
+}
+
+// Function for one of the -P lanes: runs queued batches until the input is finished
+static void xargs_lane(void *arg) {
+    struct xargs_state *state = arg;
+    for (;;) {
+        pthread_mutex_lock(&state->lock);
+        while (state->head == NULL && !state->input_done) {
+            pthread_cond_wait(&state->ready, &state->lock);
+        }
+        struct xargs_batch *batch = state->head;
+        if (batch != NULL) {
+            if ((state->head = batch->next) == NULL) {
+                state->tail = NULL;
+            }
+            state->queued--;
+            pthread_cond_signal(&state->space);
+        }
+        pthread_mutex_unlock(&state->lock);
+        if (batch == NULL) {
+            return;
+        }
+        xargs_run_batch(state, batch);
+        struct arena arena = batch->arena;  // The batch itself lives in this arena
+        arena_free(&arena);
+    }
+}
+
+// Function for copying text into the arena with every occurrence of replace substituted
+static char *xargs_substitute(struct arena *arena, const char *text, const char *replace, const char *with, size_t with_length) {
+    size_t replace_length = strlen(replace), length = 0;
+    for (const char *p = text; *p;) {
+        const char *found = replace_length > 0 ? strstr(p, replace) : NULL;
+        if (found == NULL) {
+            length += strlen(p);
+            break;
+        }
+        length += (found - p) + with_length;
+        p = found + replace_length;
+    }
+    char *result = arena_alloc(arena, length + 1), *q = result;
+    if (result == NULL) {
+        return NULL;
+    }
+    for (const char *p = text; *p;) {
+        const char *found = replace_length > 0 ? strstr(p, replace) : NULL;
+        size_t keep = found != NULL ? (size_t)(found - p) : strlen(p);
+        memcpy(q, p, keep);
+        q += keep;
+        if (found == NULL) {
+            break;
+        }
+        memcpy(q, with, with_length);
+        q += with_length;
+        p = found + replace_length;
+    }
+    *q = '\0';
+    return result;
+}
+
+// Function for turning the collected items into a batch and starting or queueing it
+static int xargs_dispatch(struct xargs_state *state) {
+    size_t item_count = state->items.length / sizeof(char *);
+    char **items = (char **)state->items.data;
+    struct xargs_batch *batch = arena_alloc(&state->arena, sizeof(*batch));
+    int argc = state->command_count + (state->replace != NULL ? 0 : (int)item_count);
+    char **argv = arena_alloc(&state->arena, (argc + 1) * sizeof(char *));
+    if (batch == NULL || argv == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < state->command_count; i++) {
+        argv[i] = state->command[i];
+        if (state->replace != NULL && i > 0 &&
+            (argv[i] = xargs_substitute(&state->arena, state->command[i], state->replace, items[0], strlen(items[0]))) == NULL) {
+            return -1;
+        }
+    }
+    if (state->replace == NULL) {
+        memcpy(argv + state->command_count, items, item_count * sizeof(char *));
+    }
+    argv[argc] = NULL;
+    *batch = (struct xargs_batch){argv, argc, state->batches++, {NULL, 0}, NULL};
+    state->items.length = 0;
+    state->batch_bytes = 0;
+
+    if (state->lanes <= 1) {
+        xargs_run_batch(state, batch);
+        arena_reset(&state->arena);
+        return 0;
+    }
+    batch->arena = state->arena;
+    state->arena = (struct arena){NULL, 0};
+    pthread_mutex_lock(&state->lock);
+    while (state->queued >= 2 * state->lanes) {
+        pthread_cond_wait(&state->space, &state->lock);
+    }
+    state->queued++;
+    if (state->tail != NULL) {
+        state->tail->next = batch;
+    } else {
+        state->head = batch;
+    }
+    state->tail = batch;
+    pthread_cond_signal(&state->ready);
+    pthread_mutex_unlock(&state->lock);
+    return 0;
+}
+
+// Function for adding one input item to the batch, starting a new batch when the item would
+// not fit into -n or into what execve accepts
+static int xargs_add_item(struct xargs_state *state, const char *text, size_t length) {
+    size_t cost = length + 1 + sizeof(char *);
+    if (length + 1 > XARGS_MAX_ARGUMENT || state->command_bytes + cost > state->max_bytes) {
+        fprintf(stderr, "xargs: argument too long: %.40s...\n", text);
+        atomic_store(&state->status, 1);
+        return 0;
+    }
+    size_t item_count = state->items.length / sizeof(char *);
+    if (item_count > 0 && (item_count >= state->max_args ||
+                           state->command_bytes + state->batch_bytes + cost > state->max_bytes)) {
+        if (xargs_dispatch(state) < 0) {
+            return -1;
+        }
+    }
+    char *item = arena_alloc(&state->arena, length + 1);
+    if (item == NULL || buffer_append(&state->items, (const char *)&item, sizeof(item)) < 0) {
+        return -1;
+    }
+    memcpy(item, text, length);
+    item[length] = '\0';
+    state->batch_bytes += cost;
+    return 0;
+}
+
+// Function for one input record: with -0 and -I the record is one item, otherwise it is split
+// into blank-separated words
+static int xargs_record(void *context, const char *text, size_t length) {
+    struct xargs_state *state = context;
+    if (state->whole_records) {
+        if (state->replace != NULL && length == 0) {
+            return 0;
+        }
+        return xargs_add_item(state, text, length);
+    }
+    for (size_t i = 0; i < length;) {
+        while (i < length && (text[i] == ' ' || text[i] == '\t')) {
+            i++;
+        }
+        size_t start = i;
+        while (i < length && text[i] != ' ' && text[i] != '\t') {
+            i++;
+        }
+        if (i > start && xargs_add_item(state, text + start, i - start) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function for the xargs builtin: xargs [-0] [-r] [-t] [-n max] [-P jobs] [-I repl] command [arg...]
+// Batches are sized to ARG_MAX less the environment; -P runs that many at once on the pool.
+int builtin_xargs(char **args, struct stream *in, struct stream *out) {
+    struct xargs_state state;
+    memset(&state, 0, sizeof(state));
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.ready, NULL);
+    pthread_cond_init(&state.space, NULL);
+    pthread_mutex_init(&state.out_lock, NULL);
+    state.out = out;
+    state.lanes = 1;
+    state.max_args = SIZE_MAX;
+    state.empty_run = 1;
+    char delimiter = '\n';
+    int nul_separated = 0, a = 1;
+    for (; args[a] != NULL && args[a][0] == '-' && args[a][1] != '\0'; a++) {
+        char flag = args[a][1];
+        if ((flag == '0' || flag == 'r' || flag == 't') && args[a][2] == '\0') {
+            nul_separated |= flag == '0';
+            state.empty_run &= flag != 'r';
+            state.trace |= flag == 't';
+            continue;
+        }
+        const char *value = args[a][2] != '\0' ? args[a] + 2 : args[++a];
+        if ((flag != 'n' && flag != 'P' && flag != 'I') || value == NULL) {
+            fprintf(stderr, "Usage: xargs [-0] [-r] [-t] [-n max] [-P jobs] [-I repl] command [arg...]\n");
+            return 1;
+        }
+        if (flag == 'n') {
+            state.max_args = strtoul(value, NULL, 10);
+        } else if (flag == 'P') {
+            state.lanes = atoi(value);
+            if (state.lanes <= 0) {
+                long cores = sysconf(_SC_NPROCESSORS_ONLN);
+                state.lanes = cores > 0 ? (int)cores : 1;
+            }
+        } else {
+            state.replace = value;
+        }
+    }
+    if (state.max_args == 0) {
+        state.max_args = 1;
+    }
+    if (state.replace != NULL) {
+        state.max_args = 1;
+        state.empty_run = 0;
+    }
+    if (nul_separated) {
+        delimiter = '\0';
+    }
+    state.whole_records = nul_separated || state.replace != NULL;
+    static char *default_command[] = {"echo", NULL};
+    state.command = args[a] != NULL ? args + a : default_command;
+    while (state.command[state.command_count] != NULL) {
+        state.command_bytes += strlen(state.command[state.command_count]) + 1 + sizeof(char *);
+        state.command_count++;
+    }
+
+    // Builtins size their tables for a command line of the shell, so batches for them stay within MAX_ARGS.
+    if (is_builtin_command(state.command[0]) && state.replace == NULL) {
+        size_t room = state.command_count < MAX_ARGS - 1 ? (size_t)(MAX_ARGS - 1 - state.command_count) : 1;
+        state.max_args = state.max_args < room ? state.max_args : room;
+    }
+    // What execve has room for: ARG_MAX less the environment and the headroom POSIX asks for.
+    long arg_max = sysconf(_SC_ARG_MAX);
+    size_t environment = 0;
+    for (char **e = environ; *e != NULL; e++) {
+        environment += strlen(*e) + 1 + sizeof(char *);
+    }
+    size_t limit = arg_max > 0 ? (size_t)arg_max : XARGS_MAX_ARGUMENT;
+    state.max_bytes = limit > environment + 2048 ? limit - environment - 2048 : 4096;
+
+    struct task_group group = TASK_GROUP_INITIALIZER;
+    for (int lane = 0; state.lanes > 1 && lane < state.lanes; lane++) {
+        thread_pool_run_stage(&group, xargs_lane, &state);
+    }
+    int failed = stream_read_lines(in, delimiter, xargs_record, &state) != 0;
+    if (!failed && (state.items.length > 0 || (state.batches == 0 && state.empty_run))) {
+        failed = xargs_dispatch(&state) < 0;
+    }
+    pthread_mutex_lock(&state.lock);
+    state.input_done = 1;
+    pthread_cond_broadcast(&state.ready);
+    pthread_mutex_unlock(&state.lock);
+    task_group_wait(&group);
+    if (failed) {
+        perror("xargs");
+    }
+    free(state.items.data);
+    arena_free(&state.arena);
+    return failed ? 1 : atomic_load(&state.status);
+}
+
+// Resources used by processes the shell reaped, added up per job
+struct job_usage {
+    struct timeval user, system;
+    long max_rss;                   // Largest resident set of a single process, in kilobytes
+    unsigned long long read_bytes;  // rchar and wchar of /proc/<pid>/io
+    unsigned long long write_bytes;
+};
+
+// Job table: processes the shell started without waiting for them (background commands and
+// pipelines, coprocesses, the commands of process substitutions). They are reaped before every
+// prompt. A background job has a process group of its own, so that the descendants it leaves
+// behind (the shell is their subreaper) are reaped and accounted to it as well.
+struct job {
+    int id;                             // Number shown by jobs (-1 if not shown), 0 for a free slot
+    int background;                     // 0 for a process substitution, which is reaped silently
+    pid_t pgid;                         // Process group of the job, 0 if it shares the shell's
+    pid_t pids[MAX_PIPELINE_STAGES];    // Processes not reaped yet are > 0
+    int pid_count;
+    struct job_usage usage;
+    char command[MAX_COMMAND_LENGTH];
+};
+
+struct job job_table[MAX_JOBS];
+int next_job_id = 1;
+char current_command_line[MAX_COMMAND_LENGTH];   // The line being executed, for the job table
+struct job_usage foreground_usage;  // Foreground commands and the orphans left in the shell's group
+atomic_int background_stages;       // Builtin stages of background pipelines still running
+
+// Function for recording processes the shell does not wait for, returns the job or NULL if the
+// table is full (the processes are then left to be reaped by nobody, as before)
+struct job *add_job(const pid_t *pids, int count, int background, pid_t pgid, const char *command) {
+    for (int j = 0; j < MAX_JOBS; j++) {
+        struct job *job = &job_table[j];
+        if (job->id != 0) {
+            continue;
+        }
+        memset(job, 0, sizeof(*job));
+        job->id = background ? next_job_id++ : -1;
+        if (background) {
+            metric_count(COUNTER_BACKGROUND_JOBS);
+            atomic_fetch_add(&active_jobs, 1);
+        }
+        job->background = background;
+        job->pgid = pgid;
+        job->pid_count = count < MAX_PIPELINE_STAGES ? count : MAX_PIPELINE_STAGES;
+        memcpy(job->pids, pids, job->pid_count * sizeof(pid_t));
+        strncpy(job->command, command, sizeof(job->command) - 1);
+        return job;
+    }
+    fprintf(stderr, "Error: Too many jobs\n");
+    return NULL;
+}
+
+// Function for finding whose usage a process counts towards: the job that lists it, else the
+// job of its process group, else the foreground commands
+static struct job_usage *usage_of_process(pid_t pid, pid_t pgid) {
+    struct job *group_job = NULL;
+    for (int j = 0; j < MAX_JOBS; j++) {
+        struct job *job = &job_table[j];
+        if (job->id == 0) {
+            continue;
+        }
+        for (int p = 0; p < job->pid_count; p++) {
+            if (job->pids[p] == pid) {
+                job->pids[p] = 0;
+                return &job->usage;
+            }
+        }
+        if (job->pgid > 0 && job->pgid == pgid) {
+            group_job = job;
+        }
+    }
+    return group_job != NULL ? &group_job->usage : &foreground_usage;
+}
+
+// Function for reading rchar and wchar of a process (still readable while it is a zombie)
+static void read_process_io(pid_t pid, unsigned long long *read_bytes, unsigned long long *write_bytes) {
+    char path[64], text[512];
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t count = fd >= 0 ? read(fd, text, sizeof(text) - 1) : -1;
+    text[count > 0 ? count : 0] = '\0';
+    const char *field;
+    *read_bytes = (field = strstr(text, "rchar: ")) != NULL ? strtoull(field + 7, NULL, 10) : 0;
+    *write_bytes = (field = strstr(text, "wchar: ")) != NULL ? strtoull(field + 7, NULL, 10) : 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// Function for reaping one exited child out of P_PID pid or P_PGID group. The child is first
+// only looked at (WNOWAIT), so that its /proc/<pid>/io can still be read; wait4 then collects
+// its rusage. Returns the pid reaped, 0 if none has exited yet (WNOHANG), -1 if none is left.
+pid_t reap_child(idtype_t type, id_t id, int options, int *status) {
+    siginfo_t info;
+    info.si_pid = 0;
+    uint64_t wait_start = options & WNOHANG ? 0 : metric_now();
+    while (waitid(type, id, &info, WEXITED | WNOWAIT | options) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    if (!(options & WNOHANG)) {
+        metric_record(HISTOGRAM_WAIT, wait_start);
+    }
+    pid_t pid = info.si_pid;
+    if (pid == 0) {
+        return 0;
+    }
+    unsigned long long read_bytes, write_bytes;
+    read_process_io(pid, &read_bytes, &write_bytes);
+    pid_t pgid = getpgid(pid);
+    struct rusage rusage;
+    int wait_status;
+    while (wait4(pid, &wait_status, 0, &rusage) < 0 && errno == EINTR) {
+    }
+    if (status != NULL) {
+        *status = wait_status;
+    }
+    struct job_usage *usage = usage_of_process(pid, pgid);
+    timeradd(&usage->user, &rusage.ru_utime, &usage->user);
+    timeradd(&usage->system, &rusage.ru_stime, &usage->system);
+    usage->max_rss = rusage.ru_maxrss > usage->max_rss ? rusage.ru_maxrss : usage->max_rss;
+    usage->read_bytes += read_bytes;
+    usage->write_bytes += write_bytes;
+    return pid;
+}
+
+// Function for formatting a byte count with a binary unit
+static void format_bytes(char *text, size_t size, unsigned long long bytes) {
+    const char *units = "BKMGT";
+    double value = bytes;
+    int unit = 0;
+    while (value >= 1024 && unit < 4) {
+        value /= 1024;
+        unit++;
+    }
+    snprintf(text, size, unit == 0 ? "%.0f%c" : "%.1f%c", value, units[unit]);
+}
+
+// Function for describing a job_usage on one line
+static void format_usage(char *text, size_t size, const struct job_usage *usage) {
+    char rss[16], read_text[16], write_text[16];
+    format_bytes(rss, sizeof(rss), (unsigned long long)usage->max_rss * 1024);
+    format_bytes(read_text, sizeof(read_text), usage->read_bytes);
+    format_bytes(write_text, sizeof(write_text), usage->write_bytes);
+    snprintf(text, size, "user %.3fs sys %.3fs maxrss %s read %s write %s",
+             usage->user.tv_sec + usage->user.tv_usec / 1e6, usage->system.tv_sec + usage->system.tv_usec / 1e6,
+             rss, read_text, write_text);
+}
+
+// Function for reaping the jobs that finished, reporting the background ones
+void reap_jobs(void) {
+    for (int j = 0; j < MAX_JOBS; j++) {
+        struct job *job = &job_table[j];
+        if (job->id == 0) {
+            continue;
+        }
+        int running = 0;
+        if (job->pgid > 0) {
+            pid_t pid;
+            while ((pid = reap_child(P_PGID, job->pgid, WNOHANG, NULL)) > 0) {
+            }
+            running = pid == 0;     // Something of the group is still alive
+        } else {
+            for (int p = 0; p < job->pid_count; p++) {
+                if (job->pids[p] > 0 && reap_child(P_PID, job->pids[p], WNOHANG, NULL) == 0) {
+                    running = 1;
+                }
+            }
+        }
+        if (!running) {
+            if (job->background) {
+                char usage[160];
+                format_usage(usage, sizeof(usage), &job->usage);
+                printf("[%d] Done %s (%s)\n", job->id, job->command, usage);
+                atomic_fetch_sub(&active_jobs, 1);
+            }
+            job->id = 0;
+        }
+    }
+    // Orphans of foreground commands land in the shell's own group. They are left alone while a
+    // background builtin stage may be waiting for children of its own there.
+    if (atomic_load(&background_stages) == 0) {
+        while (reap_child(P_PGID, getpgrp(), WNOHANG, NULL) > 0) {
+        }
+    }
+}
+
+// Function for listing the background jobs that are still running; jobs -l adds the process
+// group and what the job's reaped processes used so far
+void print_jobs(char **args, struct stream *out) {
+    int details = args[1] != NULL && strcmp(args[1], "-l") == 0;
+    for (int j = 0; j < MAX_JOBS; j++) {
+        struct job *job = &job_table[j];
+        if (job->id <= 0 || !job->background) {
+            continue;
+        }
+        stream_printf(out, "[%d] Running", job->id);
+        if (details && job->pgid > 0) {
+            stream_printf(out, " pgid %d", job->pgid);
+        }
+        for (int p = 0; p < job->pid_count; p++) {
+            if (job->pids[p] > 0) {
+                stream_printf(out, " %d", job->pids[p]);
+            }
+        }
+        stream_printf(out, " %s\n", job->command);
+        if (details) {
+            char usage[160];
+            format_usage(usage, sizeof(usage), &job->usage);
+            stream_printf(out, "    %s\n", usage);
+        }
+    }
+}
+
+// A long-lived helper started by coproc: the shell writes to its stdin and reads its stdout
+struct coprocess {
+    char name[32];              // Empty for a free slot
+    pid_t pid;
+    int to_fd, from_fd;         // The shell's ends of the two pipes
+    struct byte_buffer replies; // Output read but not returned by coread yet
+};
+
+struct coprocess coprocesses[MAX_COPROCESSES];
+
+static struct coprocess *find_coprocess(const char *name) {
+    for (int c = 0; c < MAX_COPROCESSES; c++) {
+        if (coprocesses[c].name[0] != '\0' && strcmp(coprocesses[c].name, name) == 0) {
+            return &coprocesses[c];
+        }
+    }
+    return NULL;
+}
+
+static void close_coprocess(struct coprocess *coprocess) {
+    close(coprocess->to_fd);
+    close(coprocess->from_fd);
+    free(coprocess->replies.data);
+    memset(coprocess, 0, sizeof(*coprocess));   // The process itself is reaped with the jobs
+}
+
+// Function for the coproc builtin: coproc name command [arg...] starts the command with two
+// pipes, coproc -c name closes them (the helper sees end of file), coproc lists the helpers.
+int builtin_coproc(char **args, struct stream *out) {
+    if (args[1] == NULL) {
+        for (int c = 0; c < MAX_COPROCESSES; c++) {
+            if (coprocesses[c].name[0] != '\0') {
+                stream_printf(out, "%s %d\n", coprocesses[c].name, coprocesses[c].pid);
+            }
+        }
+        return 0;
+    }
+    if (strcmp(args[1], "-c") == 0) {
+        struct coprocess *coprocess = args[2] != NULL ? find_coprocess(args[2]) : NULL;
+        if (coprocess == NULL) {
+            fprintf(stderr, "coproc: no such coprocess\n");
+            return 1;
+        }
+        close_coprocess(coprocess);
+        return 0;
+    }
+    if (args[2] == NULL) {
+        fprintf(stderr, "Usage: coproc name command [arg...] | coproc -c name\n");
+        return 1;
+    }
+    if (find_coprocess(args[1]) != NULL || strlen(args[1]) >= sizeof(coprocesses[0].name)) {
+        fprintf(stderr, "coproc: %s: name in use or too long\n", args[1]);
+        return 1;
+    }
+    struct coprocess *coprocess = NULL;
+    for (int c = 0; c < MAX_COPROCESSES && coprocess == NULL; c++) {
+        coprocess = coprocesses[c].name[0] == '\0' ? &coprocesses[c] : NULL;
+    }
+    int to_child[2], from_child[2];
+    if (coprocess == NULL || pipe2(to_child, O_CLOEXEC) < 0) {
+        fprintf(stderr, "coproc: cannot start %s\n", args[1]);
+        return 1;
+    }
+    if (pipe2(from_child, O_CLOEXEC) < 0) {
+        perror("coproc: pipe");
+        close(to_child[0]);
+        close(to_child[1]);
+        return 1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        close(to_child[1]);
+        close(from_child[0]);
+        run_command_in_child(args + 2);
+    }
+    close(to_child[0]);
+    close(from_child[1]);
+    if (pid < 0) {
+        perror("fork");
+        close(to_child[1]);
+        close(from_child[0]);
+        return 1;
+    }
+    strcpy(coprocess->name, args[1]);
+    coprocess->pid = pid;
+    coprocess->to_fd = to_child[1];
+    coprocess->from_fd = from_child[0];
+    add_job(&pid, 1, 1, 0, current_command_line);
+    return 0;
+}
+
+// Function for the cowrite builtin: cowrite name text... sends the text as one line
+int builtin_cowrite(char **args) {
+    struct coprocess *coprocess = args[1] != NULL ? find_coprocess(args[1]) : NULL;
+    if (coprocess == NULL) {
+        fprintf(stderr, "Usage: cowrite name text...\n");
+        return 1;
+    }
+    char line[MAX_COMMAND_LENGTH + 1];
+    size_t length = 0;
+    for (int a = 2; args[a] != NULL; a++) {
+        length += snprintf(line + length, sizeof(line) - length, a > 2 ? " %s" : "%s", args[a]);
+    }
+    line[length++] = '\n';
+    if (write_all(coprocess->to_fd, line, length) < 0) {
+        fprintf(stderr, "cowrite: %s: %s\n", coprocess->name, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+// Function for the coread builtin: coread [-t seconds] name prints the next line the helper
+// wrote, waiting at most the given time (default: forever). Returns 1 on timeout or end of file.
+int builtin_coread(char **args, struct stream *out) {
+    double timeout = -1;
+    int a = 1;
+    if (args[a] != NULL && strcmp(args[a], "-t") == 0 && args[a + 1] != NULL) {
+        timeout = strtod(args[a + 1], NULL);
+        a += 2;
+    }
+    struct coprocess *coprocess = args[a] != NULL ? find_coprocess(args[a]) : NULL;
+    if (coprocess == NULL) {
+        fprintf(stderr, "Usage: coread [-t seconds] name\n");
+        return 1;
+    }
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += (time_t)timeout;
+    deadline.tv_nsec += (long)((timeout - (time_t)timeout) * 1e9);
+    for (;;) {
+        struct byte_buffer *replies = &coprocess->replies;
+        char *newline = replies->length > 0 ? memchr(replies->data, '\n', replies->length) : NULL;
+        if (newline != NULL) {
+            size_t length = newline - replies->data + 1;
+            stream_write(out, replies->data, length);
+            memmove(replies->data, replies->data + length, replies->length - length);
+            replies->length -= length;
+            return 0;
+        }
+        int wait = -1;
+        if (timeout >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long long left = (deadline.tv_sec - now.tv_sec) * 1000LL + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+            wait = left > 0 ? (int)left : 0;
+        }
+        struct pollfd fd = {coprocess->from_fd, POLLIN, 0};
+        int ready = poll(&fd, 1, wait);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready == 0) {
+            fprintf(stderr, "coread: %s: timed out\n", coprocess->name);
+            return 1;
+        }
+        ssize_t count = -1;
+        if (ready > 0 && buffer_reserve(replies, STREAM_BUFFER_SIZE) == 0) {
+            count = read(coprocess->from_fd, replies->data + replies->length, STREAM_BUFFER_SIZE);
+        }
+        if (count <= 0) {
+            if (replies->length > 0) {      // A last line without newline
+                stream_write(out, replies->data, replies->length);
+                stream_write(out, "\n", 1);
+                replies->length = 0;
+                return 0;
+            }
+            if (count < 0) {
+                fprintf(stderr, "coread: %s: %s\n", coprocess->name, strerror(errno));
+            }
+            return 1;
+        }
+        replies->length += count;
+    }
+}
+
+// Open /proc files of a process jtop watches; they are read again with pread on every refresh
+struct proc_files {
+    pid_t pid;
+    int stat_fd, statm_fd, io_fd;
+    unsigned long long ticks;       // utime + stime at the last refresh
+    int seen;                       // Refresh that last found the process
+};
+
+// One process of the /proc scan
+struct proc_sample {
+    pid_t pid, ppid, pgid;
+    char state;
+    unsigned long long ticks;
+    int counted;                    // Stamp of the job whose totals already include the process
+};
+
+struct jtop_state {
+    struct proc_files *files;
+    int file_count, file_capacity;
+    struct byte_buffer samples;     // struct proc_sample of the current refresh
+    int refresh;
+    int stamp;                      // Changes for every job summed up
+};
+
+// Function for reading a small /proc file through a kept descriptor (or opening it once)
+static ssize_t proc_read(int fd, char *buffer, size_t size) {
+    ssize_t count = pread(fd, buffer, size - 1, 0);
+    buffer[count > 0 ? count : 0] = '\0';
+    return count;
+}
+
+// Function for parsing /proc/<pid>/stat; the command name may hold spaces and parentheses
+static int parse_proc_stat(const char *text, struct proc_sample *sample) {
+    const char *p = strrchr(text, ')');
+    unsigned long long utime, stime;
+    int ppid, pgid;
+    if (p == NULL || sscanf(p + 2, "%c %d %d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+                            &sample->state, &ppid, &pgid, &utime, &stime) != 5) {
+        return -1;
+    }
+    sample->ppid = ppid;
+    sample->pgid = pgid;
+    sample->counted = 0;
+    sample->ticks = utime + stime;
+    return 0;
+}
+
+static struct proc_files *jtop_files(struct jtop_state *state, pid_t pid) {
+    for (int f = 0; f < state->file_count; f++) {
+        if (state->files[f].pid == pid) {
+            return &state->files[f];
+        }
+    }
+    return NULL;
+}
+
+// Function for opening and keeping the /proc files of a process seen for the first time
+static struct proc_files *jtop_open(struct jtop_state *state, pid_t pid) {
+    if (state->file_count == state->file_capacity) {
+        int capacity = state->file_capacity ? state->file_capacity * 2 : 16;
+        struct proc_files *files = realloc(state->files, capacity * sizeof(*files));
+        if (files == NULL) {
+            return NULL;
+        }
+        state->files = files;
+        state->file_capacity = capacity;
+    }
+    char path[64];
+    struct proc_files *files = &state->files[state->file_count];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    files->stat_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (files->stat_fd < 0) {
+        return NULL;
+    }
+    snprintf(path, sizeof(path), "/proc/%d/statm", (int)pid);
+    files->statm_fd = open(path, O_RDONLY | O_CLOEXEC);
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    files->io_fd = open(path, O_RDONLY | O_CLOEXEC);     // Not readable for other users' processes
+    files->pid = pid;
+    files->ticks = 0;
+    files->seen = state->refresh;
+    state->file_count++;
+    return files;
+}
+
+static void jtop_close(struct proc_files *files) {
+    close(files->stat_fd);
+    if (files->statm_fd >= 0) {
+        close(files->statm_fd);
+    }
+    if (files->io_fd >= 0) {
+        close(files->io_fd);
+    }
+}
+
+// Function for the /proc scan of one refresh: pid, parent, state and CPU ticks of every
+// process. Processes jtop already watches are read through their kept descriptors.
+static int jtop_scan(struct jtop_state *state) {
+    DIR *proc = opendir("/proc");
+    if (proc == NULL) {
+        return -1;
+    }
+    state->samples.length = 0;
+    struct dirent *entry;
+    char text[512];
+    while ((entry = readdir(proc)) != NULL) {
+        if (entry->d_name[0] < '1' || entry->d_name[0] > '9') {
+            continue;
+        }
+        struct proc_sample sample;
+        sample.pid = atoi(entry->d_name);
+        struct proc_files *files = jtop_files(state, sample.pid);
+        ssize_t count;
+        if (files != NULL) {
+            count = proc_read(files->stat_fd, text, sizeof(text));
+        } else {
+            char path[sizeof(entry->d_name) + 16];
+            snprintf(path, sizeof(path), "/proc/%s/stat", entry->d_name);
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            count = fd >= 0 ? proc_read(fd, text, sizeof(text)) : -1;
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        if (count > 0 && parse_proc_stat(text, &sample) == 0 &&
+            buffer_append(&state->samples, (const char *)&sample, sizeof(sample)) < 0) {
+            break;
+        }
+    }
+    closedir(proc);
+    return 0;
+}
+
+// Function for adding one process and, through the parent links of the scan, all of its
+// descendants to a job's totals; a process already counted for this job is skipped
+static void jtop_add_tree(struct jtop_state *state, pid_t root, double seconds, double *cpu,
+                          unsigned long long *rss, unsigned long long *read_bytes,
+                          unsigned long long *write_bytes, char *job_state) {
+    struct proc_sample *samples = (struct proc_sample *)state->samples.data;
+    size_t sample_count = state->samples.length / sizeof(*samples);
+    static long ticks_per_second, page_size;
+    if (ticks_per_second == 0) {
+        ticks_per_second = sysconf(_SC_CLK_TCK);
+        page_size = sysconf(_SC_PAGESIZE);
+    }
+    for (size_t s = 0; s < sample_count; s++) {
+        if (samples[s].pid != root) {
+            continue;
+        }
+        if (samples[s].counted == state->stamp) {
+            return;
+        }
+        samples[s].counted = state->stamp;
+        struct proc_files *files = jtop_files(state, root);
+        if (files == NULL && (files = jtop_open(state, root)) != NULL) {
+            files->ticks = samples[s].ticks;    // No CPU% before the second refresh
+        }
+        char text[512];
+        if (files != NULL) {
+            files->seen = state->refresh;
+            if (seconds > 0) {
+                *cpu += (samples[s].ticks - files->ticks) * 100.0 / ticks_per_second / seconds;
+            }
+            files->ticks = samples[s].ticks;
+            unsigned long long resident;
+            if (files->statm_fd >= 0 && proc_read(files->statm_fd, text, sizeof(text)) > 0 &&
+                sscanf(text, "%*u %llu", &resident) == 1) {
+                *rss += resident * page_size;
+            }
+            const char *field;
+            if (files->io_fd >= 0 && proc_read(files->io_fd, text, sizeof(text)) > 0) {
+                if ((field = strstr(text, "rchar: ")) != NULL) {
+                    *read_bytes += strtoull(field + 7, NULL, 10);
+                }
+                if ((field = strstr(text, "wchar: ")) != NULL) {
+                    *write_bytes += strtoull(field + 7, NULL, 10);
+                }
+            }
+        }
+        // R beats S beats the rest, so a job shows as running while any of its processes runs.
+        if (samples[s].state == 'R' || (samples[s].state == 'S' && *job_state != 'R') || *job_state == '-') {
+            *job_state = samples[s].state;
+        }
+        for (size_t c = 0; c < sample_count; c++) {
+            if (samples[c].ppid == root) {
+                jtop_add_tree(state, samples[c].pid, seconds, cpu, rss, read_bytes, write_bytes, job_state);
+            }
+        }
+        return;
+    }
+}
+
+// Function for rendering one refresh of jtop into a single buffer
+static void jtop_render(struct jtop_state *state, struct byte_buffer *frame, double seconds, int terminal) {
+    char line[256], rss_text[16], read_text[16], write_text[16];
+    frame->length = 0;
+    if (terminal) {
+        buffer_append(frame, "\033[H\033[2J", 7);      // Home and clear
+    }
+    int length = snprintf(line, sizeof(line), "%4s %6s %8s %8s %8s %5s  %s\n", "JOB", "CPU%", "RSS", "READ", "WRITE",
+                          "STATE", "COMMAND");
+    buffer_append(frame, line, length);
+    for (int j = 0; j < MAX_JOBS; j++) {
+        struct job *job = &job_table[j];
+        if (job->id <= 0) {
+            continue;
         }
-        path = home_directory;
-    } else {
-        if (args[1][0] == '/') {
-            // Absolute path is directly assigned.
-            path = args[1];
-        } else {
-            // Relative path
-            char current_directory[MAX_COMMAND_LENGTH];     
-            if (getcwd(current_directory, sizeof(current_directory)) == NULL) {     // retrieving current working directory
-                perror("getcwd");
-                return;
+        double cpu = 0;
+        unsigned long long rss = 0, read_bytes = 0, write_bytes = 0;
+        char job_state = '-';
+        state->stamp++;
+        for (int p = 0; p < job->pid_count; p++) {
+            if (job->pids[p] > 0) {
+                jtop_add_tree(state, job->pids[p], seconds, &cpu, &rss, &read_bytes, &write_bytes, &job_state);
             }
-            path = malloc(strlen(current_directory) + strlen(args[1]) + 2);    // For allocating memory to relative path
-            if (path == NULL) {
-                perror("malloc");
-                return;
+        }
+        // Processes that left the parent chain, such as a daemonised worker the subreaper took
+        // over, still belong to the job while they stay in its process group.
+        struct proc_sample *samples = (struct proc_sample *)state->samples.data;
+        size_t sample_count = state->samples.length / sizeof(*samples);
+        for (size_t s = 0; job->pgid > 0 && s < sample_count; s++) {
+            if (samples[s].pgid == job->pgid && samples[s].counted != state->stamp) {
+                jtop_add_tree(state, samples[s].pid, seconds, &cpu, &rss, &read_bytes, &write_bytes, &job_state);
             }
-            strcpy(path, current_directory);
-            strcat(path, "/");
-            strcat(path, args[1]);
         }
+        format_bytes(rss_text, sizeof(rss_text), rss);
+        format_bytes(read_text, sizeof(read_text), read_bytes);
+        format_bytes(write_text, sizeof(write_text), write_bytes);
+        length = snprintf(line, sizeof(line), "%4d %6.1f %8s %8s %8s %5c  %.60s\n", job->id, cpu, rss_text, read_text,
+                          write_text, job_state, job->command);
+        buffer_append(frame, line, length);
     }
-    if (chdir(path) != 0) {  // It returns a non-zero value, this means an error is indicated
-        perror("chdir");    
-    } else {
-        setenv("PWD", path, 1);  // For setting the environment variable PWD to the value of path
+}
+
+// Function for the jtop builtin: jtop [-d seconds] [-n refreshes]
+// Shows CPU%, resident memory, bytes read and written and the state of every background job,
+// summed over all processes of the job's tree, until Ctrl-C (or -n refreshes).
+int builtin_jtop(char **args, struct stream *out) {
+    double delay = 1;
+    long refreshes = -1;
+    for (int a = 1; args[a] != NULL; a++) {
+        if (strcmp(args[a], "-d") == 0 && args[a + 1] != NULL) {
+            delay = strtod(args[++a], NULL);
+        } else if (strcmp(args[a], "-n") == 0 && args[a + 1] != NULL) {
+            refreshes = strtol(args[++a], NULL, 10);
+        } else {
+            fprintf(stderr, "Usage: jtop [-d seconds] [-n refreshes]\n");
+            return 1;
+        }
     }
-    if (args[1] != NULL && args[1][0] != '/') {     // It frees dynamically allocated memory for relative path.
-        free(path);
+    if (delay <= 0) {
+        delay = 1;
+    }
+    if (interrupt_watch_begin() < 0) {
+        perror("jtop");
+        return 1;
+    }
+    struct jtop_state state;
+    memset(&state, 0, sizeof(state));
+    struct byte_buffer frame = {NULL, 0, 0};
+    int terminal = out->ring == NULL && isatty(out->fd);
+    struct timespec last, now;
+    clock_gettime(CLOCK_MONOTONIC, &last);
+    int failed = 0;
+    for (long r = 0; refreshes < 0 || r < refreshes; r++) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double seconds = r == 0 ? 0 : (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+        last = now;
+        state.refresh = r + 1;
+        if (jtop_scan(&state) < 0) {
+            perror("jtop: /proc");
+            failed = 1;
+            break;
+        }
+        jtop_render(&state, &frame, seconds, terminal);
+        // Files of processes that are gone are closed; the slot goes to the last entry.
+        for (int f = 0; f < state.file_count;) {
+            if (state.files[f].seen != state.refresh) {
+                jtop_close(&state.files[f]);
+                state.files[f] = state.files[--state.file_count];
+            } else {
+                f++;
+            }
+        }
+        // One write per refresh
+        if (stream_write(out, frame.data, frame.length) < 0 || stream_flush(out) < 0) {
+            failed = 1;
+            break;
+        }
+        if (refreshes >= 0 && r + 1 >= refreshes) {
+            break;
+        }
+        struct pollfd wake = {interrupt_wake[0], POLLIN, 0};
+        if (poll(&wake, 1, (int)(delay * 1000)) > 0) {
+            break;
+        }
+    }
+    interrupt_watch_end();
+    for (int f = 0; f < state.file_count; f++) {
+        jtop_close(&state.files[f]);
     }
+    free(state.files);
+    free(state.samples.data);
+    free(frame.data);
+    return failed;
+}
+
+// Function for checking whether a command is run by the shell itself
+int is_builtin_command(const char *name) {
+    return name != NULL && (strcmp(name, "cd") == 0 || strcmp(name, "pwd") == 0 ||
+                            strcmp(name, "history") == 0 || strcmp(name, "exit") == 0 ||
+                            strcmp(name, "fgrep") == 0 || strcmp(name, "wc") == 0 ||
+                            strcmp(name, "sort") == 0 || strcmp(name, "count") == 0 ||
+                            strcmp(name, "walk") == 0 || strcmp(name, "hashsum") == 0 ||
+                            strcmp(name, "cp") == 0 || strcmp(name, "mv") == 0 || strcmp(name, "rm") == 0 ||
+                            strcmp(name, "head") == 0 || strcmp(name, "tail") == 0 ||
+                            strcmp(name, "fanout") == 0 || strcmp(name, "shard") == 0 ||
+                            strcmp(name, "xargs") == 0 || strcmp(name, "jobs") == 0 ||
+                            strcmp(name, "coproc") == 0 || strcmp(name, "cowrite") == 0 ||
+                            strcmp(name, "coread") == 0 || strcmp(name, "jtop") == 0 ||
+                            strcmp(name, "set") == 0 || strcmp(name, "stats") == 0);
 }
 
-// Function to execute built-in commands (cd, pwd, history, exit)
-void execute_builtin_command(char **args) {
+// Function to execute built-in commands (cd, pwd, history, exit, fgrep, wc, sort, count, walk, hashsum,
+// cp, mv, rm, head, tail, fanout, shard, xargs, jobs, coproc, cowrite, coread, jtop, set, stats)
+// in and out are the streams of the builtin, the shell's own stdin and stdout outside a pipeline
+int execute_builtin_command(char **args, struct stream *in, struct stream *out) {
     if (strcmp(args[0], "cd") == 0) {       // If the given command is cd
-        change_directory(args);
+        int result = change_directory(args);
         char full_command[MAX_COMMAND_LENGTH] = {0};
         strcpy(full_command, "cd");
         if (args[1] != NULL) {
             strcat(full_command, " ");                                                     // For appending
             strncat(full_command, args[1], MAX_COMMAND_LENGTH - strlen(full_command) - 1); // For appending 
         }
+        return result == 0 ? 0 : 1;
     } else if (strcmp(args[0], "pwd") == 0) { // If the given command is pwd
         char cwd[MAX_COMMAND_LENGTH];
         if (getcwd(cwd, sizeof(cwd)) != NULL) {
-            printf("%s\n", cwd);
+            stream_printf(out, "%s\n", cwd);
         }
     } else if (strcmp(args[0], "history") == 0) { // If the given command is history
+        char snapshot[HISTORY_SIZE][MAX_COMMAND_LENGTH];
+        pthread_mutex_lock(&history_lock);  // Copying, so the lock is not held while writing to a pipe
+        if (shared_history != NULL) {
+            shared_history_sync();  // Picking up commands from the other sessions
+        }
         int count = history_count > HISTORY_SIZE ? HISTORY_SIZE : history_count;
+        memcpy(snapshot, history, sizeof(history[0]) * count);
+        pthread_mutex_unlock(&history_lock);
         for (int i = 0; i < count; i++) {
-            printf("%d: %s\n", i + 1, history[i]);
+            if (args[1] != NULL && strstr(snapshot[i], args[1]) == NULL) {
+                continue;   // history <text> only lists the commands containing text
+            }
+            stream_printf(out, "%d: %s\n", i + 1, snapshot[i]);
         }
+    } else if (strcmp(args[0], "fgrep") == 0) {    // If the given command is fgrep
+        return builtin_fgrep(args, in, out);
+    } else if (strcmp(args[0], "wc") == 0) {       // If the given command is wc
+        return builtin_wc(args, in, out);
+    } else if (strcmp(args[0], "sort") == 0) {     // If the given command is sort
+        return builtin_sort(args, in, out);
+    } else if (strcmp(args[0], "count") == 0) {    // If the given command is count
+        return builtin_count(args, in, out);
+    } else if (strcmp(args[0], "walk") == 0) {     // If the given command is walk
+        return builtin_walk(args, in, out);
+    } else if (strcmp(args[0], "hashsum") == 0) {  // If the given command is hashsum
+        return builtin_hashsum(args, in, out);
+    } else if (strcmp(args[0], "cp") == 0) {       // If the given command is cp
+        return builtin_cp(args);
+    } else if (strcmp(args[0], "mv") == 0) {       // If the given command is mv
+        return builtin_mv(args);
+    } else if (strcmp(args[0], "rm") == 0) {       // If the given command is rm
+        return builtin_rm(args);
+    } else if (strcmp(args[0], "head") == 0) {     // If the given command is head
+        return builtin_head(args, in, out);
+    } else if (strcmp(args[0], "tail") == 0) {     // If the given command is tail
+        return builtin_tail(args, in, out);
+    } else if (strcmp(args[0], "fanout") == 0) {   // If the given command is fanout
+        return builtin_fanout(args, in, out);
+    } else if (strcmp(args[0], "shard") == 0) {    // If the given command is shard
+        return builtin_shard(args, in, out);
+    } else if (strcmp(args[0], "xargs") == 0) {    // If the given command is xargs
+        return builtin_xargs(args, in, out);
+    } else if (strcmp(args[0], "jobs") == 0) {     // If the given command is jobs
+        print_jobs(args, out);
+    } else if (strcmp(args[0], "coproc") == 0) {   // If the given command is coproc
+        return builtin_coproc(args, out);
+    } else if (strcmp(args[0], "cowrite") == 0) {  // If the given command is cowrite
+        return builtin_cowrite(args);
+    } else if (strcmp(args[0], "coread") == 0) {   // If the given command is coread
+        return builtin_coread(args, out);
+    } else if (strcmp(args[0], "jtop") == 0) {     // If the given command is jtop
+        return builtin_jtop(args, out);
+    } else if (strcmp(args[0], "set") == 0) {      // If the given command is set
+        return builtin_set(args, out);
+    } else if (strcmp(args[0], "stats") == 0) {    // If the given command is stats
+        return builtin_stats(args, out);
     } else if (strcmp(args[0], "exit") == 0) {     // If the given command is exit
         printf("Exiting...\n"); // Last message in order to indicate exiting process through the user.
         exit(0);
     }
+    return 0;
+}
+
+// One builtin stage of a pipeline, owned by the thread that runs it
+struct pipeline_stage {
+    char *argv[MAX_ARGS];
+    char words[MAX_COMMAND_LENGTH + MAX_ARGS];  // Copy of the words argv points into
+    int in_fd;
+    int out_fd;
+    struct spsc_ring *in_ring;      // Set when fused with the builtin stage before this one
+    struct spsc_ring *out_ring;     // Set when fused with the builtin stage after this one
+    int background;                 // Counted in background_stages while it runs
+};
+
+static void run_builtin_stage(void *arg) {
+    struct pipeline_stage *stage = arg;
+    struct stream in, out;
+    if (stage->in_ring != NULL) {
+        stream_init_ring(&in, stage->in_ring);
+    } else {
+        stream_init(&in, stage->in_fd);
+    }
+    if (stage->out_ring != NULL) {
+        stream_init_ring(&out, stage->out_ring);
+    } else {
+        stream_init(&out, stage->out_fd);
+    }
+    // cd and exit would act on the whole shell; like in a subshell they do nothing here.
+    if (strcmp(stage->argv[0], "cd") != 0 && strcmp(stage->argv[0], "exit") != 0) {
+        uint64_t start = metric_now();
+        execute_builtin_command(stage->argv, &in, &out);
+        metric_record(HISTOGRAM_BUILTIN, start);
+        metric_count(COUNTER_BUILTINS);
+    }
+    stream_close(&out);
+    if (stage->in_ring != NULL) {
+        spsc_ring_close(stage->in_ring, 0);
+    } else if (stage->in_fd != STDIN_FILENO) {
+        close(stage->in_fd);
+    }
+    if (stage->out_ring != NULL) {
+        spsc_ring_close(stage->out_ring, 1);   // Lets the next stage see end of input
+    } else if (stage->out_fd != STDOUT_FILENO) {
+        close(stage->out_fd);   // Lets the next stage see end of file
+    }
+    if (stage->background) {
+        atomic_fetch_sub(&background_stages, 1);
+    }
+    free(stage);
+}
+
+// Function for copying a stage's words, so that a background stage outlives the command buffer
+static struct pipeline_stage *make_pipeline_stage(char **args, int in_fd, int out_fd,
+                                                  struct spsc_ring *in_ring, struct spsc_ring *out_ring) {
+    struct pipeline_stage *stage = malloc(sizeof(*stage));
+    if (stage == NULL) {
+        return NULL;
+    }
+    char *word = stage->words;
+    int i;
+    for (i = 0; args[i] != NULL; i++) {
+        size_t length = strlen(args[i]) + 1;
+        memcpy(word, args[i], length);
+        stage->argv[i] = word;
+        word += length;
+    }
+    stage->argv[i] = NULL;
+    stage->in_fd = in_fd;
+    stage->out_fd = out_fd;
+    stage->in_ring = in_ring;
+    stage->out_ring = out_ring;
+    stage->background = 0;
+    return stage;
+}
+
+// Function to execute a pipeline of any number of stages.
+// External stages are forked as before; builtin stages run on the thread pool at the same
+// time, so neither they nor the shell's main thread hold the other stages up. Adjacent
+// builtin stages are fused: they hand data over through an in-memory ring, and kernel pipes
+// are only created where a builtin meets an external process.
+int run_pipeline(char *stages[][MAX_ARGS], int count, int background) {
+    struct task_group group = TASK_GROUP_INITIALIZER;
+    pid_t pids[MAX_PIPELINE_STAGES];
+    int pid_count = 0;
+    int in_fd = STDIN_FILENO;
+    struct spsc_ring *in_ring = NULL;
+    pid_t leader = 0;       // Process group of a background pipeline
+    int last_external = 0;  // The last stage is a process, whose exit status is the pipeline's
+
+    fflush(stdout);
+    for (int s = 0; s < count; s++) {
+        int builtin = is_builtin_command(stages[s][0]);
+        int pipefd[2] = {-1, STDOUT_FILENO};
+        struct spsc_ring *out_ring = NULL;
+        int failed = 0;
+        if (s < count - 1 && builtin && is_builtin_command(stages[s + 1][0])) {
+            failed = (out_ring = spsc_ring_create()) == NULL;
+        } else if (s < count - 1) {
+            // Close-on-exec keeps the pipe ends held by builtin stages out of the external stages.
+            failed = pipe2(pipefd, O_CLOEXEC) == -1;
+        }
+        if (failed) {
+            perror("pipe");
+            if (in_ring != NULL) {
+                spsc_ring_close(in_ring, 0);
+            } else if (in_fd != STDIN_FILENO) {
+                close(in_fd);
+            }
+            break;
+        }
+        int out_fd = pipefd[1];
+
+        if (builtin) {
+            struct pipeline_stage *stage = make_pipeline_stage(stages[s], in_fd, out_fd, in_ring, out_ring);
+            if (stage != NULL) {
+                // The stage now owns its input and output and closes them when it is done.
+                stage->background = background;
+                if (background) {
+                    atomic_fetch_add(&background_stages, 1);
+                }
+                thread_pool_run_stage(background ? NULL : &group, run_builtin_stage, stage);
+            } else {
+                perror("malloc");
+                if (in_ring != NULL) {
+                    spsc_ring_close(in_ring, 0);
+                } else if (in_fd != STDIN_FILENO) {
+                    close(in_fd);
+                }
+                if (out_ring != NULL) {
+                    spsc_ring_close(out_ring, 1);
+                } else if (out_fd != STDOUT_FILENO) {
+                    close(out_fd);
+                }
+            }
+        } else {
+            uint64_t spawn_start = metric_now();
+            pid_t pid = fork();
+            if (pid == 0) {
+                signal(SIGPIPE, SIG_DFL);
+                if (background) {
+                    setpgid(0, leader);
+                }
+                if (in_fd != STDIN_FILENO) {
+                    dup2(in_fd, STDIN_FILENO);
+                    close(in_fd);
+                }
+                if (out_fd != STDOUT_FILENO) {
+                    dup2(out_fd, STDOUT_FILENO);
+                    close(out_fd);
+                }
+                execvp(stages[s][0], stages[s]);
+                perror("execvp");
+                _exit(EXIT_FAILURE);    // exit would flush the script's stdio buffer and rewind it
+            } else if (pid < 0) {
+                perror("fork");
+                metric_count(COUNTER_SPAWN_FAILURES);
+            } else {
+                metric_record(HISTOGRAM_SPAWN, spawn_start);
+                metric_count(COUNTER_PROCESSES);
+                pids[pid_count++] = pid;
+                last_external = s == count - 1;
+                if (background) {
+                    setpgid(pid, leader != 0 ? leader : pid);   // Both sides, whichever runs first
+                    leader = leader != 0 ? leader : pid;
+                }
+            }
+            if (in_fd != STDIN_FILENO) {
+                close(in_fd);
+            }
+            if (out_fd != STDOUT_FILENO) {
+                close(out_fd);
+            }
+        }
+        in_fd = pipefd[0];
+        in_ring = out_ring;
+    }
+
+    int status = 0;
+    if (!background) {
+        for (int p = 0; p < pid_count; p++) {
+            reap_child(P_PID, pids[p], 0, p == pid_count - 1 && last_external ? &status : NULL);
+        }
+        task_group_wait(&group);
+        status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        if (status != 0) {
+            metric_count(COUNTER_FAILED_COMMANDS);
+        }
+    } else if (pid_count > 0) {
+        add_job(pids, pid_count, 1, leader, current_command_line);
+        printf("Background processes started with PID:");
+        for (int p = 0; p < pid_count; p++) {
+            printf(p == 0 ? " %d" : p == pid_count - 1 ? " and %d" : ", %d", pids[p]);
+        }
+        printf("\n");
+    }
+    return status;
 }
 
 // Function to execute a command sequence with optional background execution (non built-in commands)
 // it also handles commands includes &&, and waits until first argument to finish correctly and then executes second argument
 // Sample command: gcc main.c && ./a.out 
 int run_sequence_command(char **args, int background) {
+    uint64_t spawn_start = metric_now();
     pid_t pid = fork();
     if (pid < 0) {
         perror("fork");
+        metric_count(COUNTER_SPAWN_FAILURES);
         return -1; // error
     } else if (pid == 0) {
+        signal(SIGPIPE, SIG_DFL);   // The shell ignores it, the command should not
+        if (background) {
+            setpgid(0, 0);
+        }
         if (execvp(args[0], args) == -1) {
             fprintf(stderr, "Error: Command not found\n"); // If there is a typo in command.
-            exit(EXIT_FAILURE);
+            _exit(EXIT_FAILURE);    // exit would flush the script's stdio buffer and rewind it
         }
     } else {
+        metric_record(HISTOGRAM_SPAWN, spawn_start);
+        metric_count(COUNTER_PROCESSES);
         if (!background) {
-            int status;
-            waitpid(pid, &status, 0);
+            int status = 0;
+            reap_child(P_PID, pid, 0, &status);
+            if (status != 0) {
+                metric_count(COUNTER_FAILED_COMMANDS);
+            }
             if (WIFEXITED(status)) {
                 return WEXITSTATUS(status);
             }
         } else {
+            setpgid(pid, pid);
+            add_job(&pid, 1, 1, pid, current_command_line);
             printf("Background process with PID: %d\n", pid);
         }
     }
     return 0; // success or background mode
 }
 
+// Function to execute one command that is not part of a pipeline, returns its exit status.
+// Built-in commands run in the shell itself (in the foreground), everything else is forked.
+int run_simple_command(char **args, int background) {
+    if (is_builtin_command(args[0])) {
+        struct stream in, out;
+        stream_init(&in, STDIN_FILENO);
+        stream_init(&out, STDOUT_FILENO);
+        fflush(stdout);
+        uint64_t start = metric_now();
+        int status = execute_builtin_command(args, &in, &out);
+        metric_record(HISTOGRAM_BUILTIN, start);
+        metric_count(COUNTER_BUILTINS);
+        stream_close(&out);
+        return status;
+    }
+    return run_sequence_command(args, background);
+}
+
+// Function for running a simple command, traced when set -x is on
+int xtrace_simple_command(char **args, int background) {
+    if (!atomic_load(&xtrace.enabled)) {
+        return run_simple_command(args, background);
+    }
+    double start = xtrace_clock();
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "+ [%.6f]", start);
+    xtrace_words(prefix, args, MAX_ARGS);
+    int status = run_simple_command(args, background);
+    if (atomic_load(&xtrace.timing) && !background) {
+        double end = xtrace_clock();
+        snprintf(prefix, sizeof(prefix), "+ [%.6f] %.6fs status %d:", end, end - start, status);
+        xtrace_words(prefix, args, MAX_ARGS);
+    }
+    return status;
+}
+
+// Function for running a pipeline traced (set -x), its stages joined by |
+void xtrace_pipeline(char *stages[][MAX_ARGS], int count, int background) {
+    char *words[MAX_PIPELINE_STAGES * MAX_ARGS];
+    int word_count = 0;
+    for (int s = 0; s < count; s++) {
+        if (s > 0) {
+            words[word_count++] = "|";
+        }
+        for (int w = 0; stages[s][w] != NULL; w++) {
+            words[word_count++] = stages[s][w];
+        }
+    }
+    double start = xtrace_clock();
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "+ [%.6f]", start);
+    xtrace_words(prefix, words, word_count);
+    int status = run_pipeline(stages, count, background);
+    if (atomic_load(&xtrace.timing) && !background) {
+        double end = xtrace_clock();
+        snprintf(prefix, sizeof(prefix), "+ [%.6f] %.6fs status %d:", end, end - start, status);
+        xtrace_words(prefix, words, word_count);
+    }
+}
+
+void execute_command_line(char *command);
+
+// Process substitutions of one command line: the shell's ends of their pipes, which the outer
+// command opens as /dev/fd/N, and the processes running the inner commands
+struct substitutions {
+    int fds[MAX_ARGS];
+    pid_t pids[MAX_ARGS];
+    int count;
+};
+
+// Function for starting the inner command of <(...) (output) or >(...) (input). The shell keeps
+// one end of a pipe without close-on-exec, so that the outer command inherits it.
+static int start_substitution(struct substitutions *substitutions, char *inner, int output) {
+    int pipefd[2];
+    if (substitutions->count == MAX_ARGS || pipe(pipefd) < 0) {
+        fprintf(stderr, "Error: Cannot start process substitution\n");
+        return -1;
+    }
+    int shell_end = output ? pipefd[0] : pipefd[1], child_end = output ? pipefd[1] : pipefd[0];
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // The child must not hold the shell's ends of the other substitutions either.
+        for (int s = 0; s < substitutions->count; s++) {
+            close(substitutions->fds[s]);
+        }
+        close(shell_end);
+        dup2(child_end, output ? STDOUT_FILENO : STDIN_FILENO);
+        close(child_end);
+        execute_command_line(inner);
+        fflush(stdout);
+        // Not exit: flushing the inherited stdin buffer would move the offset the shell reads
+        // its commands from back, and the shell would run those lines again.
+        _exit(EXIT_SUCCESS);
+    }
+    close(child_end);
+    if (pid < 0) {
+        perror("fork");
+        close(shell_end);
+        return -1;
+    }
+    substitutions->fds[substitutions->count] = shell_end;
+    substitutions->pids[substitutions->count++] = pid;
+    return shell_end;
+}
+
+// Function for replacing every <(command) and >(command) word of a line by /dev/fd/N after
+// starting all of the commands, so that they run at the same time as each other.
+// Returns -1 (nothing left running) if a substitution is unbalanced or cannot be started.
+static int expand_substitutions(const char *command, char *expanded, size_t size, struct substitutions *substitutions) {
+    size_t length = 0;
+    for (const char *p = command; *p != '\0';) {
+        int word_start = p == command || p[-1] == ' ' || p[-1] == '\t';
+        if (word_start && (p[0] == '<' || p[0] == '>') && p[1] == '(') {
+            const char *end = p + 2;
+            for (int depth = 1; *end != '\0' && (depth > 1 || *end != ')'); end++) {
+                depth += *end == '(' ? 1 : *end == ')' ? -1 : 0;
+            }
+            if (*end != ')') {
+                fprintf(stderr, "Error: Missing ) in process substitution\n");
+                return -1;
+            }
+            char inner[MAX_COMMAND_LENGTH];
+            snprintf(inner, sizeof(inner), "%.*s", (int)(end - p - 2), p + 2);
+            int fd = start_substitution(substitutions, inner, p[0] == '<');
+            if (fd < 0) {
+                return -1;
+            }
+            length += snprintf(expanded + length, size - length, "/dev/fd/%d", fd);
+            p = end + 1;
+        } else if (length + 1 < size) {
+            expanded[length++] = *p++;
+        } else {
+            p++;
+        }
+        if (length >= size) {
+            fprintf(stderr, "Error: Command too long\n");
+            return -1;
+        }
+    }
+    expanded[length] = '\0';
+    return 0;
+}
+
+// Function for closing the shell's ends of the substitutions once the outer command is done
+// (or started, in the background); their processes go into the job table to be reaped.
+static void finish_substitutions(struct substitutions *substitutions) {
+    for (int s = 0; s < substitutions->count; s++) {
+        close(substitutions->fds[s]);
+    }
+    if (substitutions->count > 0) {
+        int first = 0;
+        while (first < substitutions->count) {
+            int count = substitutions->count - first;
+            count = count < MAX_PIPELINE_STAGES ? count : MAX_PIPELINE_STAGES;
+            add_job(substitutions->pids + first, count, 0, 0, current_command_line);
+            first += count;
+        }
+    }
+    substitutions->count = 0;
+}
+
+// Function for running a command line prefixed with time: real time, then what the foreground
+// processes (and their orphans) used plus the shell's own threads running builtins, to stderr
+void time_command_line(char *command) {
+    struct timespec start, end;
+    struct rusage self_before, self_after;
+    unsigned long long read_before, write_before, read_after, write_after;
+    reap_jobs();    // Orphans of earlier commands are not counted
+    struct job_usage earlier = foreground_usage;
+    foreground_usage = (struct job_usage){0};
+    read_process_io(getpid(), &read_before, &write_before);
+    getrusage(RUSAGE_SELF, &self_before);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    execute_command_line(command);
+    if (atomic_load(&background_stages) == 0) {
+        while (reap_child(P_PGID, getpgrp(), WNOHANG, NULL) > 0) {
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &self_after);
+    read_process_io(getpid(), &read_after, &write_after);
+    struct job_usage usage = foreground_usage;
+    timeradd(&earlier.user, &usage.user, &earlier.user);    // The running totals go on
+    timeradd(&earlier.system, &usage.system, &earlier.system);
+    earlier.max_rss = usage.max_rss > earlier.max_rss ? usage.max_rss : earlier.max_rss;
+    earlier.read_bytes += usage.read_bytes;
+    earlier.write_bytes += usage.write_bytes;
+    foreground_usage = earlier;
+    struct timeval delta;
+    timersub(&self_after.ru_utime, &self_before.ru_utime, &delta);
+    timeradd(&usage.user, &delta, &usage.user);
+    timersub(&self_after.ru_stime, &self_before.ru_stime, &delta);
+    timeradd(&usage.system, &delta, &usage.system);
+    usage.read_bytes += read_after - read_before;
+    usage.write_bytes += write_after - write_before;
+    char text[160];
+    format_usage(text, sizeof(text), &usage);
+    fflush(stdout);
+    fprintf(stderr, "real %.3fs %s\n", (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, text);
+}
+
+// Counters of stat, in the order they are printed
+struct stat_counter {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+    int fd;                 // -1 if the counter could not be opened
+};
+
+// Function for opening a disabled counter on the calling process that every thread and child
+// created afterwards inherits; their counts are added in when they exit
+static int open_stat_counter(struct stat_counter *counter) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counter->type;
+    attr.config = counter->config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;    // Allowed with perf_event_paranoid 2
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    counter->fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    return counter->fd;
+}
+
+// Function for reading a counter, scaled up when the kernel had to multiplex it
+static int read_stat_counter(const struct stat_counter *counter, double *value) {
+    uint64_t values[3];     // Value, time enabled, time running
+    if (counter->fd < 0 || read(counter->fd, values, sizeof(values)) != sizeof(values) || values[2] == 0) {
+        return -1;
+    }
+    *value = values[2] < values[1] ? (double)values[0] * values[1] / values[2] : (double)values[0];
+    return 0;
+}
+
+// Function for running a command line under stat -- (perf stat for a whole pipeline or && chain).
+// A forked copy of the shell opens the counters on itself before running the line, so every
+// process and builtin thread it starts is counted, and stays their subreaper until all are gone.
+// Without perf_event_open the totals come from getrusage.
+void stat_command_line(char *command) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Fork failed");
+        return;
+    }
+    if (pid > 0) {
+        reap_child(P_PID, pid, 0, NULL);
+        return;
+    }
+
+    struct stat_counter counters[] = {
+        {"task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, -1},
+        {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1},
+        {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1},
+        {"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1},
+        {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, -1},
+    };
+    int counter_count = sizeof(counters) / sizeof(counters[0]), opened = 0, open_error = 0;
+    for (int c = 0; c < counter_count; c++) {
+        if (open_stat_counter(&counters[c]) >= 0) {
+            opened++;
+        } else {
+            open_error = errno;
+        }
+    }
+    prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0);
+    char line[MAX_COMMAND_LENGTH];
+    strncpy(line, command, sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\0';
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int c = 0; c < counter_count; c++) {
+        if (counters[c].fd >= 0) {
+            ioctl(counters[c].fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    execute_command_line(line);
+    while (waitpid(-1, NULL, 0) > 0 || errno == EINTR) {
+        // Background commands of the line and orphaned descendants count too
+    }
+
+    for (int c = 0; c < counter_count; c++) {
+        if (counters[c].fd >= 0) {
+            ioctl(counters[c].fd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fflush(stdout);
+    xtrace_flush();
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "\n Performance counter stats for '%s':\n\n", command);
+    if (opened == 0) {
+        struct rusage self, children;
+        getrusage(RUSAGE_SELF, &self);
+        getrusage(RUSAGE_CHILDREN, &children);
+        double user = self.ru_utime.tv_sec + children.ru_utime.tv_sec + (self.ru_utime.tv_usec + children.ru_utime.tv_usec) / 1e6;
+        double system = self.ru_stime.tv_sec + children.ru_stime.tv_sec + (self.ru_stime.tv_usec + children.ru_stime.tv_usec) / 1e6;
+        fprintf(stderr, "    (counters unavailable: %s, from rusage)\n", strerror(open_error));
+        fprintf(stderr, "%18.2f msec task-clock\n", (user + system) * 1e3);
+        fprintf(stderr, "%18ld kB   maxrss\n", self.ru_maxrss > children.ru_maxrss ? self.ru_maxrss : children.ru_maxrss);
+        fprintf(stderr, "%18ld      context-switches\n", self.ru_nvcsw + self.ru_nivcsw + children.ru_nvcsw + children.ru_nivcsw);
+        fprintf(stderr, "%18ld      page-faults\n", self.ru_minflt + self.ru_majflt + children.ru_minflt + children.ru_majflt);
+        fprintf(stderr, "\n%18.9f seconds time elapsed\n%18.9f seconds user\n%18.9f seconds sys\n\n", elapsed, user, system);
+        _exit(0);
+    }
+    double values[sizeof(counters) / sizeof(counters[0])];
+    int valid[sizeof(counters) / sizeof(counters[0])];
+    for (int c = 0; c < counter_count; c++) {
+        valid[c] = read_stat_counter(&counters[c], &values[c]) == 0;
+    }
+    for (int c = 0; c < counter_count; c++) {
+        if (!valid[c]) {
+            fprintf(stderr, "%18s      %s\n", "<not supported>", counters[c].name);
+        } else if (c == 0) {
+            fprintf(stderr, "%18.2f msec %-14s #  %.3f CPUs utilized\n", values[c] / 1e6, counters[c].name,
+                    elapsed > 0 ? values[c] / 1e9 / elapsed : 0);
+        } else if (c == 2 && valid[1] && values[1] > 0) {
+            fprintf(stderr, "%18.0f      %-14s #  %.2f insn per cycle\n", values[c], counters[c].name, values[c] / values[1]);
+        } else {
+            fprintf(stderr, "%18.0f      %s\n", values[c], counters[c].name);
+        }
+    }
+    fprintf(stderr, "\n%18.9f seconds time elapsed\n\n", elapsed);
+    _exit(0);
+}
+
 // Function to parse a command and execute it
 void process_command_line(char *command) {
-    char *args[MAX_ARGS];
-    char *left_args[MAX_ARGS];
-    char *right_args[MAX_ARGS];
+    uint64_t start = metric_now();
+    add_to_history(command);  // Adding the full command line to history immediately
+    metric_record(HISTOGRAM_HISTORY, start);
+    metric_count(COUNTER_COMMAND_LINES);
+    if (strncmp(command, "time ", 5) == 0) {
+        time_command_line(command + 5);
+    } else if (strncmp(command, "stat -- ", 8) == 0) {
+        stat_command_line(command + 8);
+    } else {
+        execute_command_line(command);
+    }
+}
+
+// A command line split into words: up to MAX_PIPELINE_STAGES commands connected with |, or one
+// command && another. The words point into the line, which the tokenizer cuts up.
+struct parsed_command {
+    char *stages[MAX_PIPELINE_STAGES][MAX_ARGS];
+    int stage_count;
     char *second_command[MAX_ARGS];
-    char *token;
-    int i = 0, j = 0, in_pipe = 0, background = 0, has_second_command = 0;
+    int has_second_command;
+    int background;
+};
 
-    add_to_history(command);  // Adding the full command line to history immediately
+// Function for tokenizing a command line, returns -1 (after reporting it) if it has too many stages
+int parse_command_line(char *command, struct parsed_command *parsed) {
+    char **left_args = parsed->stages[0];
+    char *token;
+    int i = 0, j = 0;
+    parsed->stage_count = 1;
+    parsed->background = 0;
+    parsed->has_second_command = 0;
 
     // Initial tokenization to handle spaces and basic command splitting
     token = strtok(command, " \t\n");
     while (token != NULL) {
-        if (strcmp(token, "&") == 0 && !in_pipe && !has_second_command) {
-            background = 1;
+        if (strcmp(token, "&") == 0 && !parsed->has_second_command) {
+            parsed->background = 1;
             break;
         } else if (strcmp(token, "|") == 0) {
-            in_pipe = 1;
-            left_args[j] = NULL;
+            if (parsed->stage_count == MAX_PIPELINE_STAGES) {
+                fprintf(stderr, "Error: Too many pipeline stages\n");
+                return -1;
+            }
+            parsed->stages[parsed->stage_count - 1][j] = NULL;
+            parsed->stage_count++;
             j = 0;
         } else if (strcmp(token, "&&") == 0) {
             left_args[j] = NULL;
             i = 0;
-            has_second_command = 1;
+            parsed->has_second_command = 1;
         } else {
-            if (in_pipe) {
-                right_args[j++] = token;
-            } else if (has_second_command) {
-                second_command[i++] = token;
-            } else {
-                left_args[j++] = token;
+            if (parsed->has_second_command) {
+                if (i < MAX_ARGS - 1) {
+                    parsed->second_command[i++] = token;
+                }
+            } else if (j < MAX_ARGS - 1) {
+                parsed->stages[parsed->stage_count - 1][j++] = token;
             }
         }
         token = strtok(NULL, " \t\n");
     }
-    left_args[j] = NULL;
-    right_args[j] = NULL;
-    second_command[i] = NULL;
+    parsed->stages[parsed->stage_count - 1][j] = NULL;
+    parsed->second_command[i] = NULL;
+    return 0;
+}
 
-    // Checking for built-in commands before any execution
-    if (left_args[0] && (strcmp(left_args[0], "cd") == 0 || strcmp(left_args[0], "pwd") == 0 ||
-        strcmp(left_args[0], "history") == 0 || strcmp(left_args[0], "exit") == 0)) {
-        execute_builtin_command(left_args);
+// Function to execute a command line without recording it (also used for the commands of
+// process substitutions)
+void execute_command_line(char *command) {
+    struct parsed_command parsed;
+    char **left_args = parsed.stages[0];
+    char expanded[4 * MAX_COMMAND_LENGTH];
+    struct substitutions substitutions = {.count = 0};
+    uint64_t parse_start = metric_now();
+    strncpy(current_command_line, command, MAX_COMMAND_LENGTH - 1);
+    if (strstr(command, "<(") != NULL || strstr(command, ">(") != NULL) {
+        if (expand_substitutions(command, expanded, sizeof(expanded), &substitutions) < 0) {
+            finish_substitutions(&substitutions);
+            return;
+        }
+        command = expanded;
+    }
+    if (parse_command_line(command, &parsed) < 0) {
+        finish_substitutions(&substitutions);
         return;
     }
-    
-    if (in_pipe) {
-        // Handling command that has pipe operator
-        int pipefd[2];
-        if (pipe(pipefd) == -1) {
-            perror("pipe");
-            return;
+    metric_record(HISTOGRAM_PARSE, parse_start);
+
+    if (parsed.stage_count > 1) {
+        // Handling command that has pipe operators
+        for (int s = 0; s < parsed.stage_count; s++) {
+            if (parsed.stages[s][0] == NULL) {
+                fprintf(stderr, "Error: Missing command in pipeline\n");
+                finish_substitutions(&substitutions);
+                return;
+            }
         }
-        pid_t pid1 = fork();
-        if (pid1 == 0) {
-            close(pipefd[0]);
-            dup2(pipefd[1], STDOUT_FILENO);
-            close(pipefd[1]);
-            execvp(left_args[0], left_args);
-            perror("execvp");
-            exit(EXIT_FAILURE);
-        }
-        pid_t pid2 = fork();
-        if (pid2 == 0) {
-            close(pipefd[1]);
-            dup2(pipefd[0], STDIN_FILENO);
-            close(pipefd[0]);
-            execvp(right_args[0], right_args);
-            perror("execvp");
-            exit(EXIT_FAILURE);
-        }
-        close(pipefd[0]);
-        close(pipefd[1]);
-        if (!background) {
-            waitpid(pid1, NULL, 0);
-            waitpid(pid2, NULL, 0);
+        if (atomic_load(&xtrace.enabled)) {
+            xtrace_pipeline(parsed.stages, parsed.stage_count, parsed.background);
         } else {
-            printf("Background processes started with PID: %d and %d\n", pid1, pid2);
+            run_pipeline(parsed.stages, parsed.stage_count, parsed.background);
         }
-    } else if (has_second_command) {
+        finish_substitutions(&substitutions);
+        return;
+    }
+
+    if (parsed.has_second_command) {
         // Handling sequential execution with &&
-        int exit_status = run_sequence_command(left_args, background);
+        int exit_status = xtrace_simple_command(left_args, parsed.background);
         if (exit_status == 0) {
-            run_sequence_command(second_command, background);
+            xtrace_simple_command(parsed.second_command, parsed.background);
         }
-    } else {
+    } else if (left_args[0] != NULL) {
         // Normal command execution
-        run_sequence_command(left_args, background);
+        xtrace_simple_command(left_args, parsed.background);
+    }
+    finish_substitutions(&substitutions);
+}
+
+// Script profiler (myshell --profile out.folded script.sh). A thread executing script lines takes
+// two monotonic clock and CPU clock readings per line into a buffer of its own; full buffers are
+// folded into per-line totals under a lock, and at exit the totals are written as folded stacks
+// (script;line: text;on-cpu or off-cpu microseconds) that flamegraph tools accept. Children
+// count once the shell has reaped them, so off-cpu is mostly the time spent waiting on them.
+struct profile_sample {
+    int line;
+    uint64_t wall_start, wall_end;  // CLOCK_MONOTONIC, nanoseconds
+    uint64_t cpu_start, cpu_end;    // Shell threads plus reaped children, nanoseconds
+    char text[MAX_COMMAND_LENGTH];  // The line as written, kept in the totals the first time
+};
+
+struct profile_line {
+    char *text;                     // Script line as written, NULL until it ran
+    uint64_t wall, cpu;
+    unsigned long runs;
+};
+
+struct profiler {
+    const char *path;               // NULL when not profiling
+    const char *script;
+    pid_t pid;                      // Forked children must not write the profile
+    pthread_mutex_t lock;
+    struct profile_line *lines;
+    int capacity;
+} profiler = {NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, NULL, 0};
+
+__thread struct profile_sample profile_buffer[PROFILE_BUFFER_SAMPLES];
+__thread int profile_buffered;
+
+// Function for reading a clock in nanoseconds
+static uint64_t profile_clock(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Function for the CPU time of the shell and of the children it reaped so far
+static uint64_t profile_cpu_time(void) {
+    struct timeval children;
+    timeradd(&foreground_usage.user, &foreground_usage.system, &children);
+    return profile_clock(CLOCK_PROCESS_CPUTIME_ID) + (uint64_t)children.tv_sec * 1000000000ULL + children.tv_usec * 1000ULL;
+}
+
+// Function for making room for a line number in the totals, returns -1 without memory
+static int profile_reserve(int line) {
+    if (line < profiler.capacity) {
+        return 0;
+    }
+    int capacity = profiler.capacity != 0 ? profiler.capacity : 64;
+    while (capacity <= line) {
+        capacity *= 2;
+    }
+    struct profile_line *lines = realloc(profiler.lines, capacity * sizeof(*lines));
+    if (lines == NULL) {
+        return -1;
+    }
+    memset(lines + profiler.capacity, 0, (capacity - profiler.capacity) * sizeof(*lines));
+    profiler.lines = lines;
+    profiler.capacity = capacity;
+    return 0;
+}
+
+// Function for folding the calling thread's buffered samples into the totals
+void profile_flush(void) {
+    pthread_mutex_lock(&profiler.lock);
+    for (int s = 0; s < profile_buffered; s++) {
+        struct profile_sample *sample = &profile_buffer[s];
+        if (profile_reserve(sample->line) == 0) {
+            struct profile_line *line = &profiler.lines[sample->line];
+            if (line->text == NULL) {
+                line->text = strdup(sample->text);
+            }
+            line->wall += sample->wall_end - sample->wall_start;
+            line->cpu += sample->cpu_end > sample->cpu_start ? sample->cpu_end - sample->cpu_start : 0;
+            line->runs++;
+        }
+    }
+    profile_buffered = 0;
+    pthread_mutex_unlock(&profiler.lock);
+}
+
+// Function for starting the sample of a script line; only the thread's own buffer is touched
+struct profile_sample *profile_begin(int line, const char *text) {
+    if (profile_buffered == PROFILE_BUFFER_SAMPLES) {
+        profile_flush();
+    }
+    struct profile_sample *sample = &profile_buffer[profile_buffered];
+    sample->line = line;
+    snprintf(sample->text, sizeof(sample->text), "%s", text);
+    sample->cpu_start = profile_cpu_time();
+    sample->wall_start = profile_clock(CLOCK_MONOTONIC);
+    return sample;
+}
+
+// Function for ending the sample started by profile_begin
+void profile_end(struct profile_sample *sample) {
+    sample->wall_end = profile_clock(CLOCK_MONOTONIC);
+    sample->cpu_end = profile_cpu_time();
+    profile_buffered++;
+}
+
+// Function for writing one folded frame, whose separators must not occur in it
+static void profile_write_frame(FILE *file, const char *frame) {
+    for (; *frame != '\0'; frame++) {
+        fputc(*frame == ';' ? ':' : *frame == '\n' ? ' ' : *frame, file);
+    }
+}
+
+// Function for writing the folded stacks at exit
+void profile_write(void) {
+    if (profiler.path == NULL || getpid() != profiler.pid) {
+        return;
+    }
+    profile_flush();
+    FILE *file = fopen(profiler.path, "w");
+    if (file == NULL) {
+        perror(profiler.path);
+        return;
+    }
+    const char *script = strrchr(profiler.script, '/') != NULL ? strrchr(profiler.script, '/') + 1 : profiler.script;
+    for (int l = 0; l < profiler.capacity; l++) {
+        struct profile_line *line = &profiler.lines[l];
+        if (line->runs == 0) {
+            continue;
+        }
+        uint64_t cpu = line->cpu < line->wall ? line->cpu : line->wall;
+        const char *kinds[2] = {"on-cpu", "off-cpu"};
+        uint64_t values[2] = {cpu / 1000, (line->wall - cpu) / 1000};
+        for (int k = 0; k < 2; k++) {
+            if (values[k] == 0) {
+                continue;
+            }
+            profile_write_frame(file, script);
+            fprintf(file, ";%d: ", l);
+            profile_write_frame(file, line->text);
+            fprintf(file, ";%s %llu\n", kinds[k], (unsigned long long)values[k]);
+        }
     }
+    fclose(file);
 }
 
-int main() {
+#ifndef MYSHELL_NO_MAIN    // The benchmarks include this file and bring their own main
+int main(int argc, char *argv[]) {
     char command[MAX_COMMAND_LENGTH];
+    char text[MAX_COMMAND_LENGTH];
+    FILE *input = stdin;    // Or the script given as argument, read without prompts
+    int line_number = 0;
+
+    int argi = 1;
+    if (argi + 1 < argc && strcmp(argv[argi], "--builtin") == 0) {
+        // One builtin on stdin and stdout, for children forked from pool threads (run_command_in_child)
+        struct stream builtin_in, builtin_out;
+        stream_init(&builtin_in, STDIN_FILENO);
+        stream_init(&builtin_out, STDOUT_FILENO);
+        atexit(xtrace_flush);
+        char *shared_history_path = getenv("MYSHELL_SHARED_HISTORY");
+        if (shared_history_path != NULL && shared_history_path[0] != '\0') {
+            open_shared_history(shared_history_path);
+        }
+        int status = execute_builtin_command(argv + argi + 1, &builtin_in, &builtin_out);
+        stream_close(&builtin_out);
+        return status;
+    }
+    if (argi + 1 < argc && strcmp(argv[argi], "--profile") == 0) {
+        profiler.path = argv[argi + 1];
+        argi += 2;
+    }
+    if (argi < argc) {
+        input = fopen(argv[argi], "re");     // Commands the script runs must not inherit it
+        if (input == NULL) {
+            perror(argv[argi]);
+            return 1;
+        }
+        profiler.script = argv[argi];
+    } else if (profiler.path != NULL) {
+        fprintf(stderr, "Usage: myshell --profile out.folded script\n");
+        return 2;
+    }
+    atexit(xtrace_flush);
+    start_metrics_exporter();
+    if (profiler.path != NULL) {
+        profiler.pid = getpid();
+        atexit(profile_write);
+    }
+
+    char *shared_history_path = getenv("MYSHELL_SHARED_HISTORY");
+    if (shared_history_path != NULL && shared_history_path[0] != '\0') {
+        open_shared_history(shared_history_path);
+    }
+    // A builtin writing to a pipe whose reader exited gets EPIPE instead of killing the shell.
+    signal(SIGPIPE, SIG_IGN);
+    // Descendants whose parent exits are reparented to the shell, so they are reaped and accounted.
+    prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0);
 
     while (1) {
-        printf("myshell> ");
-        // To force the output buffer to be flushed.
-        fflush(stdout);
+        reap_jobs();
+        if (input == stdin) {
+            xtrace_flush();     // A script's trace only goes out when the buffer fills, on set +x and at exit
+            printf("myshell> ");
+            // To force the output buffer to be flushed.
+            fflush(stdout);
+        }
 
-        // To read a line of input from the standard input stream.
-        if (fgets(command, sizeof(command), stdin) == NULL) {
+        // To read a line of input from the standard input stream (or the script).
+        if (fgets(command, sizeof(command), input) == NULL) {
             break;
         }
+        line_number++;
 
         // Removing newline character from the command.
         command[strcspn(command, "\n")] = '\0';
+        if (input != stdin && (command[0] == '#' || command[strspn(command, " \t")] == '\0')) {
+            continue;   // Comments, the #! line and blank lines of a script
+        }
 
         // In order to parse and execute the command
-        process_command_line(command);
+        if (profiler.path != NULL) {
+            strcpy(text, command);
+            struct profile_sample *sample = profile_begin(line_number, text);
+            process_command_line(command);
+            reap_jobs();    // Children that finished belong to this line
+            profile_end(sample);
+        } else {
+            process_command_line(command);
+        }
     }
 
     return 0;
-}
\ No newline at end of file
+}
+#endif